@@ -87,6 +87,7 @@ esp_err_t driver_fsoverbus_init(void) {
     specialfunction[EXECFILE] = execfile;
     specialfunction[HEARTBEAT] = heartbeat;
     specialfunction[PYTHONSTDIN] = pythonstdin;
+    specialfunction[XFERSTATS] = xferstats;
     
     filefunction[GETDIR] = getdir;
     filefunction[READFILE] = readfile;
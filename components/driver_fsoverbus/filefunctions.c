@@ -4,6 +4,7 @@
 #include <dirent.h>
 
 #include <esp_task_wdt.h>
+#include <esp_timer.h>
 
 #include "include/fsob_backend.h"
 #include "include/filefunctions.h"
@@ -11,6 +12,14 @@
 
 #define TAG "fsoveruart_ff"
 
+#define READFILE_CHUNK_SIZE 4096    //Bytes per fread/fsob_write_bytes when streaming a file out
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+
+static struct {
+    uint32_t bytes;
+    uint32_t us;
+} readfile_stats;                   //Last readfile transfer
+
 const char root[] = {"dflash\ndsdcard"};
 
 /***
@@ -76,6 +85,23 @@ int readfile(uint8_t *data, uint16_t command, uint32_t message_id, uint32_t size
     FILE *fptr_glb;
     fptr_glb = fopen(dir_name, "r");
     if(fptr_glb) {
+        //Stream the file out in large blocks. fsob_write_bytes blocks until the backend
+        //accepted the data (UART TX buffer/FIFO), so that is all the pacing we need.
+        //The request buffer is only sized for the path, so use our own. Allocated before
+        //the header goes out, once that is sent the host expects the whole file.
+        uint32_t chunk_size = READFILE_CHUNK_SIZE;
+        uint8_t *chunk = malloc(chunk_size);
+        if(chunk == NULL) {
+            chunk_size = RD_BUF_SIZE;
+            chunk = malloc(chunk_size);
+        }
+        if(chunk == NULL) {
+            ESP_LOGE(TAG, "No memory for read buffer");
+            fclose(fptr_glb);
+            sender(command, message_id);
+            return 1;
+        }
+
         fseek(fptr_glb, 0, SEEK_END);
         uint32_t size_file = ftell(fptr_glb);
         ESP_LOGI(TAG, "file size: %d", size_file);    
@@ -85,12 +111,27 @@ int readfile(uint8_t *data, uint16_t command, uint32_t message_id, uint32_t size
         fsob_write_bytes((const char*) header, 12);
         
         fseek(fptr_glb, 0, SEEK_SET);
-        uint32_t read_bytes;
-        do {
-            read_bytes = fread(data, 1, 128, fptr_glb);
-            fsob_write_bytes((const char*) data, read_bytes);
-            vTaskDelay(1);  //Delay task to ensure data has time to gets flushed to webusb
-        } while(read_bytes == 128);
+
+        int64_t start = esp_timer_get_time();
+        uint32_t sent = 0;
+        while(sent < size_file) {
+            uint32_t want = min(chunk_size, size_file - sent);
+            uint32_t read_bytes = fread(chunk, 1, want, fptr_glb);
+            if(read_bytes < want) {
+                //Read error: pad so the host still gets the size it was promised
+                ESP_LOGE(TAG, "Short read at %d of %d bytes", sent + read_bytes, size_file);
+                memset(&chunk[read_bytes], 0, want - read_bytes);
+            }
+            fsob_write_bytes((const char*) chunk, want);
+            sent += want;
+        }
+        free(chunk);
+
+        //Keep the figures for the XFERSTATS request, the log isn't visible on every bus
+        readfile_stats.bytes = sent;
+        readfile_stats.us = esp_timer_get_time() - start;
+        ESP_LOGI(TAG, "read %d bytes in %d ms (%d KB/s)", sent, readfile_stats.us / 1000,
+            readfile_stats.us ? (int) (((int64_t) sent * 1000000 / readfile_stats.us) / 1024) : 0);
         fclose(fptr_glb);
     } else {
         strcpy((char *) data, "Can't open file");
@@ -102,6 +143,11 @@ int readfile(uint8_t *data, uint16_t command, uint32_t message_id, uint32_t size
     return 1;
 }
 
+void readfile_get_stats(uint32_t *bytes, uint32_t *us) {
+    *bytes = readfile_stats.bytes;
+    *us = readfile_stats.us;
+}
+
 int writefile(uint8_t *data, uint16_t command, uint32_t message_id, uint32_t size, uint32_t received, uint32_t length) {
     static FILE *fptr = NULL;
     static int failed_open = 0;
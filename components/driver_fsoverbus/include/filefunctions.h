@@ -12,4 +12,6 @@ int duplfile(uint8_t *data, uint16_t command, uint32_t message_id, uint32_t size
 int mvfile(uint8_t *data, uint16_t command, uint32_t message_id, uint32_t size, uint32_t received, uint32_t length);
 int makedir(uint8_t *data, uint16_t command, uint32_t message_id, uint32_t size, uint32_t received, uint32_t length);
 
+void readfile_get_stats(uint32_t *bytes, uint32_t *us);
+
 #endif
\ No newline at end of file
@@ -10,6 +10,7 @@ enum SPECIALFUNCTIONS {
     HEARTBEAT,
     PYTHONSTDIN,
     APPFSBOOT,
+    XFERSTATS,
     SPECIALFUNCTIONSLEN
 };
 
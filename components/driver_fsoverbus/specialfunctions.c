@@ -1,5 +1,7 @@
 #include "include/packetutils.h"
 #include "include/specialfunctions.h"
+#include "include/filefunctions.h"
+#include "include/fsob_backend.h"
 
 #include <esp_sleep.h>
 #include <esp_err.h>
@@ -41,6 +43,22 @@ int pythonstdin(uint8_t *data, uint16_t command, uint32_t message_id, uint32_t s
     return 1;
 }
 
+//Figures of the last readfile: "<bytes> <microseconds>"
+int xferstats(uint8_t *data, uint16_t command, uint32_t message_id, uint32_t size, uint32_t received, uint32_t length) {
+    if(received != size) return 0;
+
+    uint32_t bytes, us;
+    readfile_get_stats(&bytes, &us);
+
+    char reply[24];
+    int len = snprintf(reply, sizeof(reply), "%u %u", bytes, us);
+    uint8_t header[PACKET_HEADER_SIZE];
+    createMessageHeader(header, command, len, message_id);
+    fsob_write_bytes((const char*) header, PACKET_HEADER_SIZE);
+    fsob_write_bytes(reply, len);
+    return 1;
+}
+
 int notsupported(uint8_t *data, uint16_t command, uint32_t message_id, uint32_t size, uint32_t received, uint32_t length) {
     if(received != size) return 1;
     sendns(command, message_id);
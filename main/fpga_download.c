@@ -1,6 +1,10 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <utime.h>
 #include <sdkconfig.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -8,6 +12,7 @@
 #include <esp_system.h>
 #include <esp_err.h>
 #include <esp_log.h>
+#include <esp_heap_caps.h>
 #include "driver/uart.h"
 #include "hardware.h"
 #include "managed_i2c.h"
@@ -16,13 +21,35 @@
 #include "system_wrapper.h"
 #include "graphics_wrapper.h"
 #include "esp32/rom/crc.h"
+#include "esp32/rom/miniz.h"
 #include "fpga_util.h"
+#include "settings.h"
+
+static const char *TAG = "fpga_download";
+
+#define FPGA_RX_CHUNK_SIZE 4096
+#define FPGA_UART_BUF_SIZE 16384
+#define FPGA_UART_BAUD     921600
+#define FPGA_CACHE_DIR     "/sd/fpga_cache"
+#define FPGA_CACHE_MAX     16       /* Entries kept, least recently used go first */
+#define FPGA_UART_EVT_LEN  16
+#define FPGA_RX_MAX_NAME   256      /* Longest path / name in 'F', 'A' and 'P' packets */
+#define FPGA_RX_MAX_BITSTREAM (512 * 1024)
+#define FPGA_RX_MAX_RATIO  1032     /* Deflate can't expand by more than this */
+
+static QueueHandle_t g_uart_evt;
+static int64_t g_uart_sync_deadline;
+static int64_t g_uart_sync_sent;
+static int64_t g_uart_sync_time;    /* Last sync word round trip (us) */
+
+static esp_err_t fpga_uart_rx_setup(void);
+static void fpga_uart_rx_cleanup(void);
 
 static void fpga_install_uart() {
     fflush(stdout);
-    ESP_ERROR_CHECK(uart_driver_install(0, 2048, 0, 0, NULL, 0));
+    ESP_ERROR_CHECK(uart_driver_install(0, FPGA_UART_BUF_SIZE, 0, FPGA_UART_EVT_LEN, &g_uart_evt, 0));
     uart_config_t uart_config = {
-        .baud_rate  = 921600,
+        .baud_rate  = FPGA_UART_BAUD,
         .data_bits  = UART_DATA_8_BITS,
         .parity     = UART_PARITY_DISABLE,
         .stop_bits  = UART_STOP_BITS_1,
@@ -30,9 +57,11 @@ static void fpga_install_uart() {
         .source_clk = UART_SCLK_APB,
     };
     ESP_ERROR_CHECK(uart_param_config(0, &uart_config));
+    ESP_ERROR_CHECK(fpga_uart_rx_setup());
 }
 
 static void fpga_uninstall_uart() {
+    fpga_uart_rx_cleanup();
     uart_driver_delete(0);
 }
 
@@ -45,9 +74,8 @@ static bool fpga_uart_sync(void) {
     static int step = 0;
     static int l;
     static uint8_t data[4];
-    static int64_t timeout;
 
-    if (step && (esp_timer_get_time() > timeout))
+    if (step && (esp_timer_get_time() > g_uart_sync_deadline))
         step = 0;
 
     switch (step) {
@@ -57,7 +85,8 @@ static bool fpga_uart_sync(void) {
         uart_write_bytes(0, "FPGA", 4);
         step++;
         l = 0;
-        timeout = esp_timer_get_time() + 500000; /* setup 0.5s timeout */
+        g_uart_sync_sent = esp_timer_get_time();
+        g_uart_sync_deadline = g_uart_sync_sent + 500000; /* setup 0.5s timeout */
         /* fall-through */
 
     /* Step 1: Receive the 'FPGA' header */
@@ -70,6 +99,7 @@ static bool fpga_uart_sync(void) {
             break;
         }
         step++;
+        g_uart_sync_time = esp_timer_get_time() - g_uart_sync_sent;
         return true;
 
     /* Step 2: Just wait for next attempt */
@@ -89,8 +119,578 @@ static bool fpga_uart_load(uint8_t* buffer, uint32_t length) {
     return fpga_read_stdin(buffer, length, 1000);
 }
 
+/*
+ * Packet payloads are received by a dedicated task into two DMA capable
+ * buffers in turn, so that one buffer fills up from UART0 while the other
+ * one is being CRC'd and consumed (copied to the data store or sent to
+ * the FPGA).
+ */
+
+struct fpga_rx_chunk {
+    uint8_t *data;
+    uint32_t len;       /* 0 means the receive timed out */
+};
+
+typedef esp_err_t (*fpga_rx_sink_t)(void *ctx, const uint8_t *data, uint32_t len);
+
+static struct {
+    TaskHandle_t  task;
+    QueueHandle_t job;      /* Payload lengths to receive */
+    QueueHandle_t full;     /* Chunks filled by the RX task */
+    QueueHandle_t empty;    /* Chunks available for filling */
+    uint8_t      *buf[2];
+
+    /* Per-phase timing (us) */
+    int64_t       t_rx;     /* Time spent waiting for data */
+    int64_t       t_crc;
+    int64_t       t_sink;   /* Consuming payloads (any packet) */
+    int64_t       t_bind;   /* Data packets: storing & binding */
+    int64_t       t_lcd;    /* LCD handover to the FPGA */
+    int64_t       t_load;   /* Bitstream packets: configuring the FPGA */
+} g_rx;
+
+static void fpga_uart_rx_task(void *arg) {
+    struct fpga_rx_chunk chunk;
+    uint32_t length;
+
+    while (true) {
+        // Wait for a payload to receive
+        xQueueReceive(g_rx.job, &length, portMAX_DELAY);
+
+        while (length) {
+            // Get a free buffer and fill it
+            xQueueReceive(g_rx.empty, &chunk, portMAX_DELAY);
+
+            chunk.len = (length > FPGA_RX_CHUNK_SIZE) ? FPGA_RX_CHUNK_SIZE : length;
+
+            if (fpga_uart_load(chunk.data, chunk.len)) {
+                length -= chunk.len;
+            } else {
+                // Report timeout and abandon the rest of the payload
+                chunk.len = 0;
+                length = 0;
+            }
+
+            // Hand it over
+            xQueueSend(g_rx.full, &chunk, portMAX_DELAY);
+        }
+    }
+}
+
+static esp_err_t fpga_uart_rx_setup(void) {
+    memset(&g_rx, 0x00, sizeof(g_rx));
+
+    g_rx.job   = xQueueCreate(1, sizeof(uint32_t));
+    g_rx.full  = xQueueCreate(2, sizeof(struct fpga_rx_chunk));
+    g_rx.empty = xQueueCreate(2, sizeof(struct fpga_rx_chunk));
+    if (!g_rx.job || !g_rx.full || !g_rx.empty)
+        return ESP_ERR_NO_MEM;
+
+    for (int i = 0; i < 2; i++) {
+        struct fpga_rx_chunk chunk = {
+            .data = heap_caps_malloc(FPGA_RX_CHUNK_SIZE, MALLOC_CAP_DMA),
+            .len  = 0,
+        };
+        if (chunk.data == NULL)
+            return ESP_ERR_NO_MEM;
+        g_rx.buf[i] = chunk.data;
+        xQueueSend(g_rx.empty, &chunk, 0);
+    }
+
+    if (xTaskCreate(fpga_uart_rx_task, "fpga_uart_rx", 2048, NULL, uxTaskPriorityGet(NULL) + 1, &g_rx.task) != pdPASS)
+        return ESP_ERR_NO_MEM;
+
+    return ESP_OK;
+}
+
+static void fpga_uart_rx_cleanup(void) {
+    if (g_rx.task)
+        vTaskDelete(g_rx.task);
+    if (g_rx.job)
+        vQueueDelete(g_rx.job);
+    if (g_rx.full)
+        vQueueDelete(g_rx.full);
+    if (g_rx.empty)
+        vQueueDelete(g_rx.empty);
+    for (int i = 0; i < 2; i++)
+        free(g_rx.buf[i]);
+    memset(&g_rx, 0x00, sizeof(g_rx));
+}
+
+static esp_err_t fpga_uart_rx_payload(uint32_t length, uint32_t *crc, fpga_rx_sink_t sink, void *ctx) {
+    struct fpga_rx_chunk chunk;
+    esp_err_t res = ESP_OK;
+    int64_t t;
+
+    *crc = 0;
+
+    if (!length)
+        return ESP_OK;
+
+    // Start the RX task
+    xQueueSend(g_rx.job, &length, portMAX_DELAY);
+
+    while (length) {
+        // Wait for the next chunk
+        t = esp_timer_get_time();
+        xQueueReceive(g_rx.full, &chunk, portMAX_DELAY);
+        g_rx.t_rx += esp_timer_get_time() - t;
+
+        if (!chunk.len) {
+            xQueueSend(g_rx.empty, &chunk, portMAX_DELAY);
+            return ESP_ERR_TIMEOUT;
+        }
+
+        length -= chunk.len;
+
+        // CRC
+        t = esp_timer_get_time();
+        *crc = crc32_le(*crc, chunk.data, chunk.len);
+        g_rx.t_crc += esp_timer_get_time() - t;
+
+        // Consume it (after an error, keep draining to stay in sync)
+        if (sink && (res == ESP_OK)) {
+            t = esp_timer_get_time();
+            res = sink(ctx, chunk.data, chunk.len);
+            g_rx.t_sink += esp_timer_get_time() - t;
+        }
+
+        // Release buffer for the RX task
+        xQueueSend(g_rx.empty, &chunk, portMAX_DELAY);
+    }
+
+    return res;
+}
+
+struct fpga_rx_mem {
+    uint8_t *data;
+    uint32_t ofs;
+};
+
+static esp_err_t fpga_rx_sink_mem(void *ctx, const uint8_t *data, uint32_t len) {
+    struct fpga_rx_mem *rm = ctx;
+    memcpy(&rm->data[rm->ofs], data, len);
+    rm->ofs += len;
+    return ESP_OK;
+}
+
+/*
+ * Bitstream cache: every bitstream received is also written to the SD card,
+ * named after its CRC32. When the host announces a bitstream with an 'H'
+ * packet and we already have it, it's loaded from there instead of being
+ * sent again. Entries are touched when used and only the most recent
+ * FPGA_CACHE_MAX are kept.
+ */
+
+static void fpga_cache_path(char *path, size_t len, uint32_t crc, bool tmp) {
+    snprintf(path, len, FPGA_CACHE_DIR "/%08x.%s", crc, tmp ? "tmp" : "bin");
+}
+
+static bool fpga_cache_lookup(uint32_t crc, uint32_t length) {
+    struct stat st;
+    char path[48];
+
+    fpga_cache_path(path, sizeof(path), crc, false);
+
+    if (stat(path, &st) != 0)
+        return false;
+
+    return st.st_size == length;
+}
+
+static esp_err_t fpga_cache_load(ICE40* ice40, uint32_t crc, uint32_t length) {
+    uint32_t checkCrc = 0;
+    uint8_t *chunk;
+    esp_err_t res;
+    bool bad = false;
+    char path[48];
+    FILE *fh;
+
+    fpga_cache_path(path, sizeof(path), crc, false);
+
+    fh = fopen(path, "rb");
+    if (!fh)
+        return ESP_ERR_NOT_FOUND;
+
+    chunk = heap_caps_malloc(FPGA_RX_CHUNK_SIZE, MALLOC_CAP_DMA);
+    if (!chunk) {
+        fclose(fh);
+        return ESP_ERR_NO_MEM;
+    }
+
+    res = fpga_bitstream_begin(ice40);
+
+    while ((res == ESP_OK) && length) {
+        uint32_t l = (length > FPGA_RX_CHUNK_SIZE) ? FPGA_RX_CHUNK_SIZE : length;
+
+        if (fread(chunk, 1, l, fh) != l) {
+            res = ESP_FAIL;
+            bad = true;
+            break;
+        }
+
+        checkCrc = crc32_le(checkCrc, chunk, l);
+        res = fpga_bitstream_write(ice40, chunk, l);
+        length -= l;
+    }
+
+    if ((res == ESP_OK) && (checkCrc != crc)) {
+        res = ESP_ERR_INVALID_CRC;
+        bad = true;
+    }
+
+    if (res == ESP_OK)
+        res = fpga_bitstream_end(ice40);
+    else
+        fpga_bitstream_abort(ice40);
+
+    free(chunk);
+    fclose(fh);
+
+    // Don't keep a bad entry around. Other failures (FPGA not reporting
+    // DONE, ...) say nothing about the file.
+    if (bad)
+        unlink(path);
+    else if (res == ESP_OK)
+        utime(path, NULL);
+
+    return res;
+}
+
+static void fpga_cache_prune(void) {
+    // Drop least recently used entries until we're within the limit
+    while (true) {
+        char path[48], oldest[48] = "";
+        time_t oldest_time = 0;
+        struct dirent *de;
+        struct stat st;
+        int count = 0;
+        DIR *dir;
+
+        dir = opendir(FPGA_CACHE_DIR);
+        if (!dir)
+            return;
+
+        while ((de = readdir(dir)) != NULL) {
+            size_t l = strlen(de->d_name);
+            if ((l < 4) || strcmp(&de->d_name[l - 4], ".bin"))
+                continue;
+
+            snprintf(path, sizeof(path), FPGA_CACHE_DIR "/%s", de->d_name);
+            if (stat(path, &st) != 0)
+                continue;
+
+            if (!count++ || (st.st_mtime < oldest_time)) {
+                oldest_time = st.st_mtime;
+                strcpy(oldest, path);
+            }
+        }
+
+        closedir(dir);
+
+        if (count <= FPGA_CACHE_MAX)
+            return;
+
+        if (unlink(oldest) != 0)
+            return;
+    }
+}
+
+static FILE *fpga_cache_create(uint32_t crc) {
+    char path[48];
+
+    mkdir(FPGA_CACHE_DIR, 0777);
+    fpga_cache_path(path, sizeof(path), crc, true);
+
+    return fopen(path, "wb");
+}
+
+static void fpga_cache_commit(FILE *fh, uint32_t crc, bool keep) {
+    char path_tmp[48];
+    char path[48];
+
+    if (fh)
+        fclose(fh);
+    else
+        keep = false;
+
+    fpga_cache_path(path_tmp, sizeof(path_tmp), crc, true);
+    fpga_cache_path(path, sizeof(path), crc, false);
+
+    if (keep) {
+        unlink(path);
+        if (rename(path_tmp, path) == 0) {
+            fpga_cache_prune();
+            return;
+        }
+    }
+
+    unlink(path_tmp);
+}
+
+/*
+ * Hot reload: the last bitstream loaded in download mode is kept in PSRAM
+ * (or, when it came from the SD cache, just its CRC / length) so it can be
+ * loaded again after an FPGA side crash without the host resending it. The
+ * data bindings stay in place for as long as we're in download mode.
+ */
+
+static struct {
+    uint8_t *data;      /* PSRAM copy, NULL if loaded from the SD cache */
+    uint32_t size;      /* Allocated */
+    uint32_t len;       /* Expected / received length */
+    uint32_t ofs;
+    uint32_t crc;
+    bool     valid;
+} g_hot;
+
+static void fpga_hot_begin(uint32_t len) {
+    g_hot.valid = false;
+    g_hot.len   = len;
+    g_hot.ofs   = 0;
+
+    if (g_hot.size < len) {
+        free(g_hot.data);
+        g_hot.data = heap_caps_malloc(len, MALLOC_CAP_SPIRAM);
+        g_hot.size = g_hot.data ? len : 0;
+    }
+}
+
+static void fpga_hot_write(const uint8_t *data, uint32_t len) {
+    if (g_hot.data && ((g_hot.ofs + len) <= g_hot.size))
+        memcpy(&g_hot.data[g_hot.ofs], data, len);
+    g_hot.ofs += len;
+}
+
+static void fpga_hot_commit(uint32_t crc, bool ok) {
+    g_hot.crc   = crc;
+    g_hot.valid = ok && g_hot.data && (g_hot.ofs == g_hot.len);
+}
+
+static void fpga_hot_from_cache(uint32_t crc, uint32_t len) {
+    free(g_hot.data);
+    memset(&g_hot, 0x00, sizeof(g_hot));
+    g_hot.crc   = crc;
+    g_hot.len   = len;
+    g_hot.valid = true;
+}
+
+static void fpga_hot_release(void) {
+    free(g_hot.data);
+    memset(&g_hot, 0x00, sizeof(g_hot));
+}
+
+static esp_err_t fpga_hot_load(ICE40* ice40) {
+    uint8_t *chunk;
+    esp_err_t res;
+
+    if (!g_hot.valid)
+        return ESP_ERR_NOT_FOUND;
+
+    if (!g_hot.data)
+        return fpga_cache_load(ice40, g_hot.crc, g_hot.len);
+
+    // PSRAM isn't DMA capable, go through a bounce buffer
+    chunk = heap_caps_malloc(FPGA_RX_CHUNK_SIZE, MALLOC_CAP_DMA);
+    if (!chunk)
+        return ESP_ERR_NO_MEM;
+
+    res = fpga_bitstream_begin(ice40);
+
+    for (uint32_t ofs = 0; (res == ESP_OK) && (ofs < g_hot.len); ofs += FPGA_RX_CHUNK_SIZE) {
+        uint32_t l = ((g_hot.len - ofs) > FPGA_RX_CHUNK_SIZE) ? FPGA_RX_CHUNK_SIZE : (g_hot.len - ofs);
+        memcpy(chunk, &g_hot.data[ofs], l);
+        res = fpga_bitstream_write(ice40, chunk, l);
+    }
+
+    if (res == ESP_OK)
+        res = fpga_bitstream_end(ice40);
+    else
+        fpga_bitstream_abort(ice40);
+
+    free(chunk);
+
+    return res;
+}
+
+struct fpga_rx_bitstream {
+    ICE40 *ice40;
+    FILE  *cache;
+};
+
+static esp_err_t fpga_rx_sink_bitstream(void *ctx, const uint8_t *data, uint32_t len) {
+    struct fpga_rx_bitstream *rb = ctx;
+
+    // Caching is best effort, just stop on error
+    if (rb->cache && (fwrite(data, 1, len, rb->cache) != len)) {
+        fclose(rb->cache);
+        rb->cache = NULL;
+    }
+
+    fpga_hot_write(data, len);
+
+    return fpga_bitstream_write(rb->ice40, data, len);
+}
+
+/*
+ * Compressed payloads ('z' data blocks, 'Z' bitstreams) are zlib streams,
+ * inflated on the fly with the ROM copy of tinfl. They're prefixed with the
+ * uncompressed length (and for bitstreams the uncompressed CRC, which is
+ * what the cache is keyed on).
+ *
+ * Data blocks are inflated straight into their req_entry, bitstreams go
+ * through a 32 KB window that is forwarded to the bitstream sink.
+ */
+
+struct fpga_rx_inflate {
+    tinfl_decompressor *inf;
+    tinfl_status        status;
+
+    /* Prefix */
+    uint8_t             hdr[8];
+    int                 hdr_len;
+    int                 hdr_used;
+    uint32_t            raw_len;
+    uint32_t            raw_crc;
+    uint32_t            comp_len;   /* Whole payload, prefix included */
+
+    /* Output */
+    uint8_t            *out;
+    size_t              out_size;
+    size_t              out_ofs;
+    bool                wrap;
+    uint32_t            total;
+    uint32_t            crc;
+
+    /* Destination */
+    uint32_t            fid;
+    struct fpga_rx_bitstream *rb;
+};
+
+static void fpga_rx_inflate_init(struct fpga_rx_inflate *ri, int hdr_len, uint32_t comp_len) {
+    memset(ri, 0x00, sizeof(struct fpga_rx_inflate));
+    ri->hdr_len  = hdr_len;
+    ri->comp_len = comp_len;
+    ri->status  = TINFL_STATUS_NEEDS_MORE_INPUT;
+}
+
+static void fpga_rx_inflate_release(struct fpga_rx_inflate *ri) {
+    free(ri->inf);
+    if (ri->wrap)
+        free(ri->out);
+    ri->inf = NULL;
+    ri->out = NULL;
+}
+
+static esp_err_t fpga_rx_inflate_start(struct fpga_rx_inflate *ri) {
+    ri->raw_len = ri->hdr[0] | (ri->hdr[1] << 8) | (ri->hdr[2] << 16) | (ri->hdr[3] << 24);
+    ri->raw_crc = ri->hdr[4] | (ri->hdr[5] << 8) | (ri->hdr[6] << 16) | (ri->hdr[7] << 24);
+
+    // Length comes from the host, check it's sane before allocating for it
+    if (ri->raw_len > (ri->rb ? FPGA_RX_MAX_BITSTREAM : FPGA_REQ_MAX_DATA))
+        return ESP_ERR_INVALID_SIZE;
+
+    if ((uint64_t)ri->raw_len > (uint64_t)(ri->comp_len - ri->hdr_len) * FPGA_RX_MAX_RATIO)
+        return ESP_ERR_INVALID_SIZE;
+
+    ri->inf = malloc(sizeof(tinfl_decompressor));
+    if (!ri->inf)
+        return ESP_ERR_NO_MEM;
+    tinfl_init(ri->inf);
+
+    if (ri->rb) {
+        // Bitstream: wrapping window, DMA capable if we can
+        ri->wrap = true;
+        ri->out_size = TINFL_LZ_DICT_SIZE;
+        ri->out = heap_caps_malloc(ri->out_size, MALLOC_CAP_DMA);
+        if (!ri->out)
+            ri->out = malloc(ri->out_size);
+
+        ri->rb->cache = fpga_cache_create(ri->raw_crc);
+        fpga_hot_begin(ri->raw_len);
+    } else {
+        // Data block: directly in its final place
+        ri->wrap = false;
+        ri->out_size = ri->raw_len;
+        ri->out = fpga_req_alloc_file_data(ri->fid, ri->raw_len);
+    }
+
+    return ri->out ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+static esp_err_t fpga_rx_sink_inflate(void *ctx, const uint8_t *data, uint32_t len) {
+    struct fpga_rx_inflate *ri = ctx;
+    esp_err_t res;
+
+    // Collect prefix
+    while (len && (ri->hdr_used < ri->hdr_len)) {
+        ri->hdr[ri->hdr_used++] = *data++;
+        len--;
+    }
+
+    if (ri->hdr_used < ri->hdr_len)
+        return ESP_OK;
+
+    if (!ri->inf) {
+        res = fpga_rx_inflate_start(ri);
+        if (res != ESP_OK)
+            return res;
+    }
+
+    // Inflate as much as we can
+    while (len || (ri->status == TINFL_STATUS_HAS_MORE_OUTPUT)) {
+        size_t in_len  = len;
+        size_t out_len = ri->out_size - ri->out_ofs;
+        uint8_t *out   = &ri->out[ri->out_ofs];
+
+        ri->status = tinfl_decompress(ri->inf, data, &in_len, ri->out, out, &out_len,
+            TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT |
+            (ri->wrap ? 0 : TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF));
+
+        data += in_len;
+        len  -= in_len;
+
+        if (out_len) {
+            ri->crc = crc32_le(ri->crc, out, out_len);
+            ri->total += out_len;
+            ri->out_ofs += out_len;
+
+            if (ri->wrap) {
+                res = fpga_rx_sink_bitstream(ri->rb, out, out_len);
+                if (res != ESP_OK)
+                    return res;
+
+                if (ri->out_ofs == ri->out_size)
+                    ri->out_ofs = 0;
+            }
+        }
+
+        if (ri->status < 0)
+            return ESP_FAIL;
+
+        // Data block overflowing its announced size
+        if (!ri->wrap && (ri->status == TINFL_STATUS_HAS_MORE_OUTPUT))
+            return ESP_FAIL;
+
+        if (ri->status == TINFL_STATUS_DONE)
+            break;
+    }
+
+    return ESP_OK;
+}
+
+static esp_err_t fpga_rx_inflate_finish(struct fpga_rx_inflate *ri) {
+    if ((ri->status != TINFL_STATUS_DONE) || (ri->total != ri->raw_len))
+        return ESP_FAIL;
+
+    if (ri->rb && (ri->crc != ri->raw_crc))
+        return ESP_ERR_INVALID_CRC;
+
+    return ESP_OK;
+}
+
 static void fpga_uart_mess(const char *fmt, ...) {
-    char message[64];
+    char message[256];
     va_list va;
     int l;
 
@@ -99,6 +699,15 @@ static void fpga_uart_mess(const char *fmt, ...) {
     l = vsnprintf(message, sizeof(message), fmt, va);
     va_end(va);
 
+    if (l < 0)
+        return;
+
+    // Truncated: keep it within the buffer and still end the line
+    if (l >= sizeof(message)) {
+        l = sizeof(message) - 1;
+        message[l - 1] = '\n';
+    }
+
     // Send message
     uart_write_bytes(0, message, l);
 }
@@ -150,9 +759,88 @@ static void fpga_display_message(
     ili9341_write(ili9341, pax_buffer->buf);
 }
 
+/*
+ * Speed negotiation: the host asks for a new baud rate with an 'S' packet
+ * (fid = baud rate, len/crc = test pattern). We answer at the current rate,
+ * switch, and check the test pattern is received intact before confirming.
+ * Any failure falls back to the default rate on both sides.
+ *
+ * There is no flow control line to the host, so the RX ring buffer is sized
+ * to absorb the consumer stalls (SD writes mostly) at the highest rates.
+ */
+
+static const uint32_t fpga_uart_bauds[] = {
+    FPGA_UART_BAUD, 1000000, 2000000, 3000000, 4000000,
+};
+
+static void fpga_uart_set_baud(uint32_t baud) {
+    uart_wait_tx_done(0, portMAX_DELAY);
+    uart_set_baudrate(0, baud);
+}
+
+static void fpga_uart_negotiate(uint32_t baud, uint32_t len, uint32_t crc) {
+    uint32_t checkCrc;
+    esp_err_t res;
+    bool valid = false;
+
+    for (int i = 0; i < sizeof(fpga_uart_bauds) / sizeof(fpga_uart_bauds[0]); i++)
+        valid |= (fpga_uart_bauds[i] == baud);
+
+    if (!valid) {
+        fpga_uart_mess("baud fail\n");
+        return;
+    }
+
+    // Acknowledge at the current rate, then switch
+    fpga_uart_mess("baud %d\n", baud);
+    fpga_uart_set_baud(baud);
+
+    // Check the test pattern
+    res = fpga_uart_rx_payload(len, &checkCrc, NULL, NULL);
+    if ((res == ESP_OK) && (checkCrc == crc)) {
+        fpga_uart_mess("baud ok\n");
+        return;
+    }
+
+    // Fall back
+    vTaskDelay(100 / portTICK_PERIOD_MS);
+    uart_set_baudrate(0, FPGA_UART_BAUD);
+    uart_flush_input(0);
+    fpga_uart_mess("baud fail\n");
+}
+
+static esp_err_t fpga_rx_sink_echo(void *ctx, const uint8_t *data, uint32_t len) {
+    uart_write_bytes(0, data, len);
+    return ESP_OK;
+}
+
+static void fpga_uart_loopback(uint32_t len, uint32_t crc) {
+    uint32_t checkCrc;
+    esp_err_t res;
+
+    // Echo everything back, the host measures throughput and errors
+    res = fpga_uart_rx_payload(len, &checkCrc, fpga_rx_sink_echo, NULL);
+    if ((res == ESP_OK) && (checkCrc == crc))
+        fpga_uart_mess("loopback ok\n");
+    else
+        fpga_uart_mess("loopback fail\n");
+}
+
+static void fpga_lcd_release(ILI9341* ili9341) {
+    ili9341_deinit(ili9341);
+    ili9341_select(ili9341, false);
+}
+
+static void fpga_lcd_handover(ILI9341* ili9341) {
+    int64_t t = esp_timer_get_time();
+    fpga_lcd_release(ili9341);
+    vTaskDelay(200 / portTICK_PERIOD_MS);
+    ili9341_select(ili9341, true);
+    g_rx.t_lcd += esp_timer_get_time() - t;
+}
+
 static bool fpga_uart_download(ICE40* ice40, pax_buf_t* pax_buffer, ILI9341* ili9341) {
     TickType_t timeout = 1000 / portTICK_PERIOD_MS;
-    uint8_t *buffer = NULL;
     bool done = false;
     struct {
         uint8_t  type;
@@ -161,110 +849,371 @@ static bool fpga_uart_download(ICE40* ice40, pax_buf_t* pax_buffer, ILI9341* ili
         uint32_t crc;
     } __attribute__((packed)) header;
 
+    int64_t t_start = esp_timer_get_time();
+
+    g_rx.t_rx = g_rx.t_crc = g_rx.t_sink = 0;
+    g_rx.t_bind = g_rx.t_lcd = g_rx.t_load = 0;
+
     while (!done)
     {
+        struct fpga_rx_bitstream rb = { ice40, NULL };
+        struct fpga_rx_inflate ri;
+        struct fpga_rx_mem rm = { NULL, 0 };
+        fpga_rx_sink_t sink = NULL;
+        void *sink_ctx = NULL;
+        bool bitstream = false;
+        uint32_t cacheCrc;
+        uint32_t checkCrc;
+        esp_err_t res;
+
         // Header
+        int64_t t_pkt  = esp_timer_get_time();
+        int64_t t_rx0  = g_rx.t_rx;
+        int64_t t_crc0 = g_rx.t_crc;
+        int64_t t_sink0 = g_rx.t_sink;
+
         uart_read_bytes(0, &header, sizeof(header), timeout);
+        g_rx.t_rx += esp_timer_get_time() - t_pkt;
 
 #if 0
         fpga_uart_mess("hdr: type=%d, fid=%08x, len=%08x, crc=%08x\n", header.type, header.fid, header.len, header.crc);
 #endif
 
-        // Payload
-        if (header.len) {
-            // Alloc zone to store content
-            buffer = malloc(header.len);
-            if (buffer == NULL) {
+        cacheCrc = header.crc;
+
+        // Prepare where the payload goes
+        switch (header.type) {
+        case 'C': // Clear
+            break;
+
+        case 'F': // File alias
+        case 'A': // AppFS file binding
+        case 'P': // Flash partition binding
+            if (header.len > FPGA_RX_MAX_NAME) {
                 fpga_display_message(pax_buffer, ili9341, 0xa85a32, 0xFFFFFFFF,
-                    "FPGA download mode\nMalloc failed");
+                    "FPGA download mode\nInvalid packet length");
                 return false;
             }
+            rm.data = malloc(header.len + 1);
+            sink = fpga_rx_sink_mem;
+            sink_ctx = &rm;
+            break;
 
-            // Read data in
-            if (!fpga_uart_load(buffer, header.len)) {
+        case 'D': // Data block, received directly in the data store
+            if (header.len > FPGA_REQ_MAX_DATA) {
                 fpga_display_message(pax_buffer, ili9341, 0xa85a32, 0xFFFFFFFF,
-                    "FPGA download mode\nTimeout while loading");
+                    "FPGA download mode\nInvalid packet length");
                 return false;
             }
+            rm.data = fpga_req_alloc_file_data(header.fid, header.len);
+            sink = fpga_rx_sink_mem;
+            sink_ctx = &rm;
+            break;
+
+        case 'S': // Speed change (fid = baud rate)
+            fpga_uart_negotiate(header.fid, header.len, header.crc);
+            continue;
 
-            // Validate CRC
-            uint32_t checkCrc = crc32_le(0, buffer, header.len);
-            if (checkCrc != header.crc) {
+        case 'L': // Loopback test
+            fpga_uart_loopback(header.len, header.crc);
+            continue;
+
+        case 'R': // Periodic button state report (fid = period in ms, 0 = off)
+            fpga_btn_set_period(header.fid);
+            continue;
+
+        case 'z': // Compressed data block
+            fpga_rx_inflate_init(&ri, 4, header.len);
+            ri.fid = header.fid;
+            sink = fpga_rx_sink_inflate;
+            sink_ctx = &ri;
+            break;
+
+        case 'H': // Bitstream announce (fid = length), load from cache if possible
+            if (!fpga_cache_lookup(header.crc, header.fid)) {
+                fpga_uart_mess("cache miss\n");
+                continue;
+            }
+            fpga_uart_mess("cache hit\n");
+            fpga_lcd_handover(ili9341);
+            bitstream = true;
+            break;
+
+        case 'X': // Reload the last bitstream (PSRAM copy or SD cache)
+            if (!g_hot.valid) {
+                fpga_uart_mess("reload failed\n");
+                continue;
+            }
+            fpga_lcd_handover(ili9341);
+            bitstream = true;
+            break;
+
+        case 'B': // Bitstream, streamed to the FPGA as it arrives
+            if (header.len > FPGA_RX_MAX_BITSTREAM) {
                 fpga_display_message(pax_buffer, ili9341, 0xa85a32, 0xFFFFFFFF,
-                    "FPGA download mode\nCRC incorrect\nProvided CRC:   %08X\nCalculated CRC: %08X",
-                    header.crc, checkCrc);
+                    "FPGA download mode\nInvalid packet length");
                 return false;
             }
+            fpga_lcd_handover(ili9341);
+            rb.cache = fpga_cache_create(header.crc);
+            fpga_hot_begin(header.len);
+            sink = fpga_rx_sink_bitstream;
+            sink_ctx = &rb;
+            bitstream = true;
+            break;
+
+        case 'Z': // Compressed bitstream
+            fpga_lcd_handover(ili9341);
+            fpga_rx_inflate_init(&ri, 8, header.len);
+            ri.rb = &rb;
+            sink = fpga_rx_sink_inflate;
+            sink_ctx = &ri;
+            bitstream = true;
+            break;
+
+        default:
+            fpga_display_message(pax_buffer, ili9341, 0xa85a32, 0xFFFFFFFF,
+                "Invalid packet type");
+            return false;
+        }
+
+        if ((sink == fpga_rx_sink_mem) && (rm.data == NULL)) {
+            fpga_display_message(pax_buffer, ili9341, 0xa85a32, 0xFFFFFFFF,
+                "FPGA download mode\nMalloc failed");
+            return false;
+        }
+
+        // Receive payload
+        res = ESP_OK;
+
+        if (header.type == 'H') {
+            int64_t t = esp_timer_get_time();
+            res = fpga_cache_load(ice40, header.crc, header.fid);
+            g_rx.t_load += esp_timer_get_time() - t;
+            if (res == ESP_OK)
+                fpga_hot_from_cache(header.crc, header.fid);
+        } else if (header.type == 'X') {
+            int64_t t = esp_timer_get_time();
+            res = fpga_hot_load(ice40);
+            g_rx.t_load += esp_timer_get_time() - t;
         } else {
-            buffer = NULL;
+            if (bitstream) {
+                int64_t t = esp_timer_get_time();
+                res = fpga_bitstream_begin(ice40);
+                g_rx.t_load += esp_timer_get_time() - t;
+            }
+
+            if (res == ESP_OK)
+                res = fpga_uart_rx_payload(header.len, &checkCrc, sink, sink_ctx);
+
+            if ((res == ESP_OK) && (checkCrc != header.crc))
+                res = ESP_ERR_INVALID_CRC;
+
+            if (sink == fpga_rx_sink_inflate) {
+                if (res == ESP_OK)
+                    res = fpga_rx_inflate_finish(&ri);
+                fpga_rx_inflate_release(&ri);
+                cacheCrc = ri.raw_crc;
+            }
+
+            if ((res == ESP_OK) && bitstream) {
+                int64_t t = esp_timer_get_time();
+                res = fpga_bitstream_end(ice40);
+                g_rx.t_load += esp_timer_get_time() - t;
+            } else if (bitstream) {
+                fpga_bitstream_abort(ice40);
+            }
+
+            if (bitstream) {
+                fpga_cache_commit(rb.cache, cacheCrc, res == ESP_OK);
+                fpga_hot_commit(cacheCrc, res == ESP_OK);
+            }
+        }
+
+        if (bitstream)
+            g_rx.t_load += g_rx.t_sink - t_sink0;
+        else
+            g_rx.t_bind += g_rx.t_sink - t_sink0;
+
+        // Handle errors
+        if (res != ESP_OK) {
+            if ((header.type == 'F') || (header.type == 'A') || (header.type == 'P'))
+                free(rm.data);
+            else if ((header.type == 'D') || (header.type == 'z'))
+                fpga_req_del_file(header.fid);
+            else if (bitstream) {
+                ice40_disable(ice40);
+                ili9341_init(ili9341);
+            }
+
+            if (res == ESP_ERR_TIMEOUT)
+                fpga_display_message(pax_buffer, ili9341, 0xa85a32, 0xFFFFFFFF,
+                    "FPGA download mode\nTimeout while loading");
+            else if (res == ESP_ERR_INVALID_CRC)
+                fpga_display_message(pax_buffer, ili9341, 0xa85a32, 0xFFFFFFFF,
+                    "FPGA download mode\nCRC incorrect\nProvided CRC:   %08X\nCalculated CRC: %08X",
+                    header.crc, checkCrc);
+            else
+                fpga_display_message(pax_buffer, ili9341, 0xa85a32, 0xFFFFFFFF,
+                    "FPGA download mode\nUpload failed: %d", res);
+
+            if (bitstream)
+                fpga_uart_mess("uploading bitstream failed with %d\n", res);
+
+            return false;
         }
 
+        // Apply
+        int64_t t_apply = esp_timer_get_time();
+
         switch (header.type) {
-        case 'C': { // Clear
+        case 'C':
             fpga_req_del_file(header.fid);
             break;
-        }
 
-        case 'F': { // File alias
-            char *path = malloc(header.len + 1);
-            memcpy(path, buffer, header.len);
-            path[header.len] = '\x00';
-            fpga_req_add_file_alias(header.fid, path);
-            free(path);
+        case 'F':
+            rm.data[header.len] = '\x00';
+            fpga_req_add_file_alias(header.fid, (char*)rm.data);
+            free(rm.data);
             break;
-        }
 
-        case 'D': { // Data block
-            fpga_req_add_file_data(header.fid, buffer, header.len);
+        case 'A':
+            rm.data[header.len] = '\x00';
+            if (fpga_req_add_file_appfs(header.fid, (char*)rm.data))
+                fpga_uart_mess("appfs file '%s' not found\n", rm.data);
+            free(rm.data);
             break;
-        }
 
-        case 'B': { // Bitstream
-            done = true;
+        case 'P': { // Offset (4), length (4), label
+            rm.data[header.len] = '\x00';
+            if (header.len < 8) {
+                fpga_uart_mess("partition binding failed\n");
+                free(rm.data);
+                break;
+            }
+            uint32_t p_ofs = rm.data[0] | (rm.data[1] << 8) | (rm.data[2] << 16) | (rm.data[3] << 24);
+            uint32_t p_len = rm.data[4] | (rm.data[5] << 8) | (rm.data[6] << 16) | (rm.data[7] << 24);
+            if (fpga_req_add_file_partition(header.fid, (char*)&rm.data[8], p_ofs, p_len))
+                fpga_uart_mess("partition binding failed\n");
+            free(rm.data);
             break;
         }
-
-        default:
-            fpga_display_message(pax_buffer, ili9341, 0xa85a32, 0xFFFFFFFF,
-                "Invalid packet type");
-            return false;
         }
 
-        if (!done)
-            free(buffer);
-    }
+        g_rx.t_bind += esp_timer_get_time() - t_apply;
 
-    // Bitstream ready, load it
-    ili9341_deinit(ili9341);
-    ili9341_select(ili9341, false);
-    vTaskDelay(200 / portTICK_PERIOD_MS);
-    ili9341_select(ili9341, true);
+        fpga_uart_mess("timing-pkt: type=%c len=%d rx=%d crc=%d sink=%d total=%d us\n",
+            header.type, header.len,
+            (int)(g_rx.t_rx - t_rx0), (int)(g_rx.t_crc - t_crc0),
+            (int)(g_rx.t_sink - t_sink0), (int)(esp_timer_get_time() - t_pkt));
 
-    esp_err_t res = ice40_load_bitstream(ice40, buffer, header.len);
-    free(buffer);
-    if (res != ESP_OK) {
-        ice40_disable(ice40);
-        ili9341_init(ili9341);
-        fpga_display_message(pax_buffer, ili9341, 0xa85a32, 0xFFFFFFFF,
-                "FPGA download mode\nUpload failed: %d", res);
-        fpga_uart_mess("uploading bitstream failed with %d\n", res);
-        return false;
+        done = bitstream;
     }
+
     fpga_uart_mess("bitstream has uploaded\n");
+    fpga_uart_mess("timing: sync=%d rx=%d crc=%d bind=%d lcd=%d load=%d total=%d us\n",
+        (int)g_uart_sync_time, (int)g_rx.t_rx, (int)g_rx.t_crc, (int)g_rx.t_bind,
+        (int)g_rx.t_lcd, (int)g_rx.t_load, (int)(esp_timer_get_time() - t_start));
+
+    // Time to the first FREAD is reported from the run loop
+    fpga_req_trace_arm();
 
     return true;
 }
 
 
+static void fpga_evt_unlink(QueueHandle_t queue, QueueSetHandle_t set, void *item) {
+    // Removal fails unless the queue is empty, and producers (rp2040 task,
+    // UART driver) may post in between, so drain and retry until it sticks
+    do {
+        while (xQueueReceive(queue, item, 0) == pdTRUE);
+    } while (xQueueRemoveFromSet(queue, set) != pdPASS);
+}
+
+static void fpga_evt_cleanup(QueueSetHandle_t set, xQueueHandle buttonQueue) {
+    rp2040_input_message_t msg;
+    uart_event_t evt;
+
+    if (!set)
+        return;
+
+    // Button queue outlives us, it must not stay linked to the set
+    fpga_evt_unlink(buttonQueue, set, &msg);
+    fpga_evt_unlink(g_uart_evt, set, &evt);
+    fpga_irq_remove_from_set(set);
+
+    vQueueDelete(set);
+}
+
+static QueueSetHandle_t fpga_evt_setup(xQueueHandle buttonQueue) {
+    QueueSetHandle_t set;
+    rp2040_input_message_t msg;
+    uart_event_t evt;
+    UBaseType_t btn_len;
+    bool btn_in = false, uart_in = false;
+
+    // Members must be empty when added, so stale presses from before we got
+    // here are dropped
+    while (xQueueReceive(buttonQueue, &msg, 0) == pdTRUE);
+    btn_len = uxQueueSpacesAvailable(buttonQueue) + uxQueueMessagesWaiting(buttonQueue);
+
+    // Room for every item all members can hold, as the set requires
+    set = xQueueCreateSet(btn_len + 1 + FPGA_UART_EVT_LEN);
+    if (!set)
+        return NULL;
+
+    xQueueReset(g_uart_evt);
+
+    // A press may sneak in before the add, drop it and retry
+    for (int i = 0; (i < 4) && !btn_in; i++) {
+        while (xQueueReceive(buttonQueue, &msg, 0) == pdTRUE);
+        btn_in = (xQueueAddToSet(buttonQueue, set) == pdPASS);
+    }
+
+    uart_in = btn_in && (xQueueAddToSet(g_uart_evt, set) == pdPASS);
+
+    if (uart_in && fpga_irq_add_to_set(set))
+        return set;
+
+    // Unlink whatever made it in
+    if (uart_in)
+        fpga_evt_unlink(g_uart_evt, set, &evt);
+    if (btn_in)
+        fpga_evt_unlink(buttonQueue, set, &msg);
+
+    vQueueDelete(set);
+    return NULL;
+}
+
 void fpga_download(xQueueHandle buttonQueue, ICE40* ice40, pax_buf_t* pax_buffer, ILI9341* ili9341) {
     fpga_display_message(pax_buffer, ili9341, 0x325aa8, 0xFFFFFFFF,
         "FPGA download mode\nPreparing...");
 
     fpga_install_uart();
-    fpga_irq_setup(ice40);
+    fpga_link_set_turbo(nvs_get_u8_default("system", "fpga.turbo", 0));
+
+    esp_err_t res = fpga_irq_setup(ice40);
+    if (res != ESP_OK) {
+        fpga_display_message(pax_buffer, ili9341, 0xa85a32, 0xFFFFFFFF,
+            "FPGA download mode\nIRQ setup failed: %d", res);
+        fpga_uart_mess("irq setup failed with %d\n", res);
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        fpga_uninstall_uart();
+        return;
+    }
+
     fpga_req_setup();
+    fpga_wb_async_start(ice40);
     fpga_btn_reset();
 
+    // FPGA IRQ, buttons and UART data all wake up the run loop
+    QueueSetHandle_t evt_set = fpga_evt_setup(buttonQueue);
+    if (!evt_set) {
+        fpga_display_message(pax_buffer, ili9341, 0xa85a32, 0xFFFFFFFF,
+            "FPGA download mode\nFailed to setup events");
+        goto error;
+    }
+
     ice40_disable(ice40);
     ili9341_init(ili9341);
 
@@ -287,36 +1236,140 @@ void fpga_download(xQueueHandle buttonQueue, ICE40* ice40, pax_buf_t* pax_buffer
         fpga_display_message(pax_buffer, ili9341, 0x325aa8, 0xFFFFFFFF,
             "FPGA download mode\nReceiving bitstream...");
 
-        if (!fpga_uart_download(ice40, pax_buffer, ili9341))
+        bool ok = fpga_uart_download(ice40, pax_buffer, ili9341);
+
+        // Back to default speed for the next sync
+        fpga_uart_set_baud(FPGA_UART_BAUD);
+
+        if (!ok)
             goto error;
 
         // Waiting for next download and sending key strokes to FPGA
+        struct fpga_req_stats stats_prev = { 0 };
+        struct fpga_irq_stats irq_stats_prev = { 0 };
+        int64_t stats_next = esp_timer_get_time() + 5000000;
+        uint32_t btn_lat_max = 0;
+        bool fread1_pending = true;
+        bool reload_armed = true;
+
         while (true) {
-            esp_err_t res;
-            bool work_done = false;
+            QueueSetMemberHandle_t evt;
+            int64_t t_wake, t_next;
+            TickType_t wait;
 
             if (fpga_uart_sync()) {
                 break;
             }
 
-            work_done |= fpga_btn_forward_events(ice40, buttonQueue, &res);
+            // Sleep until something fires or the next sync retry / report is due
+            t_next = (g_uart_sync_deadline < stats_next) ? g_uart_sync_deadline : stats_next;
+            if (fpga_btn_next_report() < t_next)
+                t_next = fpga_btn_next_report();
+            t_wake = esp_timer_get_time();
+            wait   = (t_next > t_wake) ? (pdMS_TO_TICKS((t_next - t_wake) / 1000) + 1) : 0;
+
+            evt = xQueueSelectFromSet(evt_set, wait);
+            t_wake = esp_timer_get_time();
+
+            // Only the member the set selected is read, and exactly one
+            // item of it, anything else would leave stale set entries.
+            // Button messages already queued are merged in a single report
+            // by selecting again as long as the set hands us the buttons.
+            uint16_t btn_changed = 0;
+
+            while (evt == buttonQueue) {
+                rp2040_input_message_t btn_msg;
+                if (xQueueReceive(buttonQueue, &btn_msg, 0) == pdTRUE)
+                    btn_changed |= fpga_btn_apply(&btn_msg);
+                evt = xQueueSelectFromSet(evt_set, 0);
+            }
+
+            if (evt == g_uart_evt) {
+                uart_event_t uart_evt;
+                xQueueReceive(g_uart_evt, &uart_evt, 0);
+            }
+
+            // First file request after the bitstream loaded
+            if (fread1_pending && (fpga_req_trace_first_fread() >= 0)) {
+                fpga_uart_mess("timing: fread1=%d us\n", (int)fpga_req_trace_first_fread());
+                fread1_pending = false;
+            }
+
+            // Report read-ahead cache efficiency when it changes
+            if (esp_timer_get_time() > stats_next) {
+                struct fpga_req_stats stats;
+                fpga_req_get_stats(&stats);
+                if (memcmp(&stats, &stats_prev, sizeof(stats))) {
+                    fpga_uart_mess("req: hits=%d misses=%d prefetched=%d written=%d dropped=%d\n",
+                        stats.hits, stats.misses, stats.prefetched,
+                        stats.wr_bytes, stats.wr_dropped);
+                    stats_prev = stats;
+                }
+
+                struct fpga_irq_stats irq_stats;
+                fpga_irq_get_stats(&irq_stats);
+                if (memcmp(&irq_stats, &irq_stats_prev, sizeof(irq_stats))) {
+                    fpga_uart_mess("irq: irqs=%d polls=%d src=%d/%d/%d/%d unhandled=%d\n",
+                        irq_stats.irqs, irq_stats.polls,
+                        irq_stats.served[0], irq_stats.served[1],
+                        irq_stats.served[2], irq_stats.served[3],
+                        irq_stats.unhandled);
+                    fpga_uart_mess("lat: irq avg=%d max=%d us btn max=%d us\n",
+                        irq_stats.irqs ? (int)(irq_stats.lat_sum / irq_stats.irqs) : 0,
+                        irq_stats.lat_max, btn_lat_max);
+                    irq_stats_prev = irq_stats;
+                }
+                stats_next = esp_timer_get_time() + 5000000;
+            }
+
+            // Button event (or periodic report due)
+            if (fpga_btn_report(ice40, btn_changed, &res)) {
+                uint32_t lat = esp_timer_get_time() - t_wake;
+                if (lat > btn_lat_max)
+                    btn_lat_max = lat;
+            }
             if (res != ESP_OK) {
                 ice40_disable(ice40);
                 ili9341_init(ili9341);
                 fpga_display_message(pax_buffer, ili9341, 0xa85a32, 0xFFFFFFFF,
-                    "FPGA download mode\nBTN error: %d", res);
+                    "FPGA download mode\nBTN error: %d\nHOME+START to reload\nHOME+BACK to exit", res);
                 fpga_uart_mess("processing buttons events failed with %d\n", res);
-                goto error;
             }
 
-            fpga_req_process(ice40, work_done ? 0 : (50 / portTICK_PERIOD_MS), &res);
+            // FPGA IRQ, the dispatcher takes the selected semaphore
+            res = ESP_OK;
+            if (fpga_irq_is_member(evt))
+                fpga_irq_dispatch(ice40, 0, &res);
             if (res != ESP_OK) {
                 ice40_disable(ice40);
                 ili9341_init(ili9341);
                 fpga_display_message(pax_buffer, ili9341, 0xa85a32, 0xFFFFFFFF,
-                    "FPGA download mode\nREQ error: %d", res);
+                    "FPGA download mode\nREQ error: %d\nHOME+START to reload\nHOME+BACK to exit", res);
                 fpga_uart_mess("processing fpga requests failed with %d\n", res);
-                goto error;
+            }
+
+            // Leave download mode, works whatever state the design is in
+            if ((fpga_btn_get_state() & FPGA_BTN_EXIT) == FPGA_BTN_EXIT) {
+                fpga_uart_mess("exit\n");
+                ice40_disable(ice40);
+                ili9341_init(ili9341);
+                goto done;
+            }
+
+            // Reload combo, once per press
+            if ((fpga_btn_get_state() & FPGA_BTN_RELOAD) != FPGA_BTN_RELOAD) {
+                reload_armed = true;
+            } else if (reload_armed) {
+                reload_armed = false;
+                fpga_lcd_handover(ili9341);
+                res = fpga_hot_load(ice40);
+                if (res != ESP_OK) {
+                    ice40_disable(ice40);
+                    ili9341_init(ili9341);
+                    fpga_display_message(pax_buffer, ili9341, 0xa85a32, 0xFFFFFFFF,
+                        "FPGA download mode\nReload failed: %d", res);
+                }
+                fpga_uart_mess("reload %s\n", (res == ESP_OK) ? "ok" : "failed");
             }
         }
         ice40_disable(ice40);
@@ -327,8 +1380,69 @@ void fpga_download(xQueueHandle buttonQueue, ICE40* ice40, pax_buf_t* pax_buffer
 
 error:
     vTaskDelay(1000 / portTICK_PERIOD_MS);
+done:
+    fpga_evt_cleanup(evt_set, buttonQueue);
+    fpga_hot_release();
+    fpga_wb_async_stop();
     fpga_req_cleanup();
     fpga_irq_cleanup(ice40);
     fpga_uninstall_uart();
     return;
 }
+
+void fpga_launch(xQueueHandle buttonQueue, ICE40* ice40, pax_buf_t* pax_buffer, ILI9341* ili9341, const char* name) {
+    esp_err_t res;
+    int64_t t_start, t_load;
+
+    t_start = esp_timer_get_time();
+
+    fpga_link_set_turbo(nvs_get_u8_default("system", "fpga.turbo", 0));
+
+    res = fpga_irq_setup(ice40);
+    if (res != ESP_OK) {
+        fpga_display_message(pax_buffer, ili9341, 0xa85a32, 0xFFFFFFFF,
+            "FPGA\nIRQ setup failed: %d", res);
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        return;
+    }
+
+    fpga_req_setup();
+    fpga_btn_reset();
+
+    // Hand the LCD over and configure straight from flash. The LCD stays
+    // deselected while configuring instead of the fixed 200 ms settle
+    // delay of fpga_lcd_handover(), keeping the switch fast.
+    fpga_lcd_release(ili9341);
+    t_load = esp_timer_get_time();
+    res = fpga_lib_load(ice40, name);
+    t_load = esp_timer_get_time() - t_load;
+    ili9341_select(ili9341, true);
+
+    if (res != ESP_OK) {
+        ice40_disable(ice40);
+        ili9341_init(ili9341);
+        fpga_display_message(pax_buffer, ili9341, 0xa85a32, 0xFFFFFFFF,
+            "FPGA\nFailed to load '%s': %d", name, res);
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        goto done;
+    }
+
+    ESP_LOGI(TAG, "'%s' launched in %d us (configuration %d us)", name,
+        (int)(esp_timer_get_time() - t_start), (int)t_load);
+
+    // Run the design until HOME is pressed
+    while (!(fpga_btn_get_state() & FPGA_BTN_HOME)) {
+        fpga_btn_forward_events(ice40, buttonQueue, &res);
+        if (res == ESP_OK)
+            fpga_irq_dispatch(ice40, 10 / portTICK_PERIOD_MS, &res);
+        if (res != ESP_OK)
+            break;
+    }
+
+    ice40_disable(ice40);
+    ili9341_init(ili9341);
+
+done:
+    fpga_req_cleanup();
+    fpga_irq_cleanup(ice40);
+}
@@ -2,6 +2,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 #include <driver/gpio.h>
@@ -10,7 +12,9 @@
 #include "ice40.h"
 #include "rp2040.h"
 #include "fpga_test.h"
+#include "fpga_util.h"
 #include "pax_gfx.h"
+#include "settings.h"
 #include "test_common.h"
 
 extern const uint8_t fpga_selftest_bin_start[] asm("_binary_fpga_selftest_bin_start");
@@ -54,15 +58,56 @@ static const char *TAG = "fpga_test";
 
 /* SoC commands */
 
+/*
+ * The SoC usually answers within microseconds, so responses are first
+ * busy-polled for a budget that follows recent response times, then we
+ * sleep on the FPGA IRQ line. The IRQ wait is one tick at a time so the
+ * response still gets polled if the gateware doesn't raise IRQ_n for it.
+ */
+
+#define SOC_TIMEOUT_DEFAULT         pdMS_TO_TICKS(500)
+#define SOC_SPIN_MIN_US             50
+#define SOC_SPIN_MAX_US             2000
+
+static bool     g_soc_irq;                  /* FPGA IRQ armed for completions */
+static uint32_t g_soc_resp_us = 200;        /* Running average of response time */
+
+static void soc_irq_setup(ICE40* ice40) {
+    g_soc_irq = (fpga_irq_setup(ice40) == ESP_OK);
+    if (!g_soc_irq) {
+        ESP_LOGW(TAG, "FPGA IRQ unavailable, polling SoC responses");
+        fpga_irq_cleanup(ice40);
+    }
+}
+
+static void soc_irq_cleanup(ICE40* ice40) {
+    if (g_soc_irq)
+        fpga_irq_cleanup(ice40);
+    g_soc_irq = false;
+}
+
+static int64_t soc_spin_budget(void) {
+    uint32_t us = 2 * g_soc_resp_us;
+
+    if (us < SOC_SPIN_MIN_US)
+        us = SOC_SPIN_MIN_US;
+    if (us > SOC_SPIN_MAX_US)
+        us = SOC_SPIN_MAX_US;
+
+    return us;
+}
+
 static bool soc_message(ICE40* ice40, uint8_t cmd, uint32_t param, uint32_t *resp, TickType_t ticks_to_wait) {
     esp_err_t res;
     uint8_t data_tx[6];
     uint8_t data_rx[6];
+    int64_t t_start, t_spin, t_now;
+    TickType_t t_end;
+    bool done = false;
 
-    /* Default delay */
-    ticks_to_wait /= 10;    /* We do 10 retries */
+    /* Default timeout */
     if (!ticks_to_wait)
-        ticks_to_wait = pdMS_TO_TICKS(50);
+        ticks_to_wait = SOC_TIMEOUT_DEFAULT;
 
     /* Prepare message */
     data_tx[0] = SPI_CMD_SOC_MSG;
@@ -71,6 +116,10 @@ static bool soc_message(ICE40* ice40, uint8_t cmd, uint32_t param, uint32_t *res
     data_tx[3] = (param >>  8) & 0xff;
     data_tx[4] = (param      ) & 0xff;
 
+    /* Drop stale IRQ edges (e.g. left by the IRQ_n test) */
+    if (g_soc_irq)
+        fpga_irq_wait(0);
+
     /* Send message to PicoRV */
     res = ice40_send_turbo(ice40, data_tx, 5);
     if (res != ESP_OK) {
@@ -78,10 +127,14 @@ static bool soc_message(ICE40* ice40, uint8_t cmd, uint32_t param, uint32_t *res
         return false;
     }
 
+    t_start = esp_timer_get_time();
+    t_spin  = t_start + soc_spin_budget();
+    t_end   = xTaskGetTickCount() + ticks_to_wait;
+
     /* Poll until we get a response */
     data_tx[0] = SPI_CMD_RESP_ACK;
 
-    for (int i=0; i<10; i++) {
+    while (1) {
         /* Poll */
         res = ice40_transaction(ice40, data_tx, 6, data_rx, 6);
         if (res != ESP_OK) {
@@ -89,19 +142,40 @@ static bool soc_message(ICE40* ice40, uint8_t cmd, uint32_t param, uint32_t *res
             return false;
         }
 
+        t_now = esp_timer_get_time();
+
         /* Was response valid ? */
-        if (data_rx[1] & 0x80)
+        if (data_rx[1] & 0x80) {
+            done = true;
+            break;
+        }
+
+        /* Busy poll while within budget */
+        if (t_now < t_spin)
+            continue;
+
+        if ((int32_t)(xTaskGetTickCount() - t_end) >= 0)
             break;
 
-        /* Wait before retry */
-        vTaskDelay(ticks_to_wait);
+        /* Sleep until IRQ or next tick */
+        if (g_soc_irq)
+            fpga_irq_wait(1);
+        else
+            vTaskDelay(1);
     }
 
-    if (!(data_rx[1] & 0x80)) {
+    if (!done) {
         ESP_LOGE(TAG, "SoC response RX timeout");
         return false;
     }
 
+    /* Adapt spin budget, slow commands (PSRAM test, ...) are capped so
+     * they don't make everyone else spin */
+    uint32_t dt = t_now - t_start;
+    if (dt > SOC_SPIN_MAX_US)
+        dt = SOC_SPIN_MAX_US;
+    g_soc_resp_us += ((int32_t)dt - (int32_t)g_soc_resp_us) / 8;
+
     /* Report response */
     if (resp) {
         *resp = 0;
@@ -435,6 +509,9 @@ bool run_fpga_tests(xQueueHandle buttonQueue, pax_buf_t* pax_buffer, ILI9341* il
     pax_background(pax_buffer, 0x8060f0);
     ili9341_write(ili9341, pax_buffer->buf);
 
+    /* SoC responses are signaled on the FPGA IRQ line */
+    soc_irq_setup(ice40);
+
     /* Run mandatory tests */
     RUN_TEST_MANDATORY("Bitstream load", test_bitstream_load);
     RUN_TEST_MANDATORY("SPI loopback",   test_spi_loopback);
@@ -498,11 +575,278 @@ error:
     ili9341_write(ili9341, pax_buffer->buf);
 
     /* Cleanup */
+    soc_irq_cleanup(ice40);
     ice40_disable(ice40);
 
     return ok;
 }
 
+/* SPI benchmark */
+
+#define BENCH_ITERATIONS    64
+#define BENCH_LOOPBACK_MAX  256     /* Largest payload the loopback echoes */
+#define BENCH_MAX_SIZE      4096
+
+enum bench_mode {
+    BENCH_TX,                       /* ice40_send */
+    BENCH_TX_TURBO,                 /* ice40_send_turbo */
+    BENCH_RX_FULL,                  /* ice40_transaction (RESP_ACK) */
+    BENCH_RX_HALF,                  /* ice40_receive */
+    BENCH_MODES
+};
+
+static const char *bench_mode_names[BENCH_MODES] = { "tx", "tx-turbo", "rx-full", "rx-half" };
+
+static const uint32_t bench_sizes[] = { 4, 16, 64, 256, 1024, 4096 };
+#define BENCH_SIZES (sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+
+struct bench_result {
+    bool    valid;                  /* Point was measured */
+    bool    ok;                     /* All transactions succeeded and echoed back intact */
+    int64_t time;                   /* Time spent in the measured transactions (us) */
+};
+
+static void _bench_pattern(uint8_t *buf, uint32_t len, uint8_t seed) {
+    /* Same LFSR as the loopback test, seeded per iteration */
+    buf[0] = seed | 1;
+    for (uint32_t i = 1; i < len; i++)
+        buf[i] = (buf[i-1] << 1) ^ ((buf[i-1] & 0x80) ? 0x1d : 0x00);
+}
+
+static void _bench_flush(ICE40* ice40) {
+    uint8_t data_tx[2] = { SPI_CMD_NOP2, SPI_CMD_NOP2 };
+    uint8_t data_rx[2];
+
+    /* Acknowledge whatever responses a failed point left behind */
+    for (int i = 0; i < 4; i++) {
+        data_tx[0] = SPI_CMD_NOP2;
+        if (ice40_transaction(ice40, data_tx, 2, data_rx, 2) != ESP_OK)
+            return;
+        if (!(data_rx[1] & 0x80))
+            return;
+        data_tx[0] = SPI_CMD_RESP_ACK;
+        if (ice40_send(ice40, data_tx, 1) != ESP_OK)
+            return;
+    }
+}
+
+static void _bench_point(ICE40* ice40, enum bench_mode mode, uint32_t size, uint8_t *data_tx, uint8_t *data_rx, struct bench_result *r) {
+    bool loopback = size <= BENCH_LOOPBACK_MAX;
+    esp_err_t res = ESP_OK;
+    int64_t t;
+
+    r->valid = loopback || (mode == BENCH_TX) || (mode == BENCH_TX_TURBO);
+    r->ok    = true;
+    r->time  = 0;
+
+    if (!r->valid)
+        return;
+
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        /* Fresh pattern each time so stale data can't pass the check */
+        _bench_pattern(&data_tx[1], size, i);
+
+        /* RX modes need a response queued first */
+        if (mode == BENCH_RX_FULL || mode == BENCH_RX_HALF) {
+            data_tx[0] = SPI_CMD_LOOPBACK;
+            res = ice40_send(ice40, data_tx, size + 1);
+            if (res != ESP_OK)
+                break;
+        }
+
+        /* Measured transaction. Payloads too large for the loopback are
+         * sent as NOP so they only measure raw TX throughput. */
+        switch (mode) {
+            case BENCH_TX:
+                data_tx[0] = loopback ? SPI_CMD_LOOPBACK : SPI_CMD_NOP1;
+                t = esp_timer_get_time();
+                res = ice40_send(ice40, data_tx, size + 1);
+                break;
+            case BENCH_TX_TURBO:
+                data_tx[0] = loopback ? SPI_CMD_LOOPBACK : SPI_CMD_NOP1;
+                t = esp_timer_get_time();
+                res = ice40_send_turbo(ice40, data_tx, size + 1);
+                break;
+            case BENCH_RX_FULL:
+                data_tx[0] = SPI_CMD_RESP_ACK;
+                t = esp_timer_get_time();
+                res = ice40_transaction(ice40, data_tx, size + 2, data_rx, size + 2);
+                break;
+            case BENCH_RX_HALF:
+            default:
+                t = esp_timer_get_time();
+                res = ice40_receive(ice40, data_rx, size + 2);
+                break;
+        }
+
+        r->time += esp_timer_get_time() - t;
+
+        if (res != ESP_OK)
+            break;
+
+        if (!loopback)
+            continue;
+
+        /* Read back (TX modes) or acknowledge (half duplex) the response */
+        if (mode == BENCH_TX || mode == BENCH_TX_TURBO) {
+            data_tx[0] = SPI_CMD_RESP_ACK;
+            res = ice40_transaction(ice40, data_tx, size + 2, data_rx, size + 2);
+        } else if (mode == BENCH_RX_HALF) {
+            data_tx[0] = SPI_CMD_RESP_ACK;
+            res = ice40_send(ice40, data_tx, 1);
+        }
+
+        if (res != ESP_OK)
+            break;
+
+        /* Validate echo */
+        if (!(data_rx[1] & 0x80) || memcmp(&data_rx[2], &data_tx[1], size)) {
+            ESP_LOGE(TAG, "SPI benchmark %s/%u integrity fail at iteration %d", bench_mode_names[mode], size, i);
+            r->ok = false;
+            break;
+        }
+    }
+
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "SPI benchmark %s/%u transaction failed (%d)", bench_mode_names[mode], size, res);
+        r->ok = false;
+    }
+
+    if (!r->ok)
+        _bench_flush(ice40);
+}
+
+void fpga_spi_bench(xQueueHandle buttonQueue, pax_buf_t* pax_buffer, ILI9341* ili9341) {
+    ICE40* ice40 = get_ice40();
+    const pax_font_t *font;
+    struct bench_result results[BENCH_MODES][BENCH_SIZES];
+    int64_t t_tx[2] = { 0, 0 };
+    int64_t t_pack[2] = { 0, 0 };
+    bool pack_ok;
+    bool turbo_ok = true;
+    bool turbo;
+    uint8_t *data_tx, *data_rx;
+    uint32_t rc;
+    char line[64];
+
+    /* Screen init */
+    font = pax_get_font("sky mono");
+
+    pax_noclip(pax_buffer);
+    pax_background(pax_buffer, 0x8060f0);
+    pax_draw_text(pax_buffer, 0xffffffff, font, 18, 0, 0, "SPI benchmark...");
+    ili9341_write(ili9341, pax_buffer->buf);
+
+    /* DMA capable buffers, with room for command and status bytes */
+    data_tx = heap_caps_malloc(BENCH_MAX_SIZE + 2, MALLOC_CAP_DMA);
+    data_rx = heap_caps_malloc(BENCH_MAX_SIZE + 2, MALLOC_CAP_DMA);
+
+    if (!data_tx || !data_rx) {
+        pax_draw_text(pax_buffer, 0xffff0000, font, 18, 0, 20, "Out of memory");
+        ili9341_write(ili9341, pax_buffer->buf);
+        goto error;
+    }
+
+    /* Selftest gateware provides the loopback */
+    if (!test_bitstream_load(&rc)) {
+        snprintf(line, sizeof(line), "Bitstream load failed: %08x", rc);
+        pax_draw_text(pax_buffer, 0xffff0000, font, 18, 0, 20, line);
+        ili9341_write(ili9341, pax_buffer->buf);
+        goto error;
+    }
+
+    /* Sweep */
+    for (int m = 0; m < BENCH_MODES; m++) {
+        for (int s = 0; s < BENCH_SIZES; s++) {
+            struct bench_result *r = &results[m][s];
+            uint32_t size = bench_sizes[s];
+
+            _bench_point(ice40, m, size, data_tx, data_rx, r);
+
+            if (!r->valid)
+                continue;
+
+            printf("spi-bench: %-8s %4u B  %6.2f MB/s  %7.1f us/xfer%s\n",
+                bench_mode_names[m], size,
+                r->time ? (float)(size * BENCH_ITERATIONS) / r->time : 0.0f,
+                (float)r->time / BENCH_ITERATIONS,
+                r->ok ? "" : "  FAIL");
+
+            if (m == BENCH_TX || m == BENCH_TX_TURBO)
+                t_tx[m] += r->time;
+            if (m == BENCH_TX_TURBO)
+                turbo_ok &= r->ok;
+        }
+    }
+
+    /* Wishbone word packing, CPU only */
+    pack_ok = fpga_wb_pack_bench(BENCH_MAX_SIZE / 4, BENCH_ITERATIONS, &t_pack[0], &t_pack[1]);
+
+    printf("spi-bench: pack     %4u B  bswap %7.1f us  bytes %7.1f us%s\n",
+        BENCH_MAX_SIZE,
+        (float)t_pack[0] / BENCH_ITERATIONS,
+        (float)t_pack[1] / BENCH_ITERATIONS,
+        pack_ok ? "" : "  FAIL");
+
+    /* Results: MB/s and us per transaction for each mode / size */
+    pax_background(pax_buffer, 0x8060f0);
+    pax_draw_text(pax_buffer, 0xffffffff, font, 9, 0, 0, "size  MB/s  us per transaction");
+
+    for (int m = 0; m < BENCH_MODES; m++) {
+        pax_draw_text(pax_buffer, 0xffffff00, font, 9, 0, 14 + m * 44, bench_mode_names[m]);
+
+        for (int s = 0; s < BENCH_SIZES; s++) {
+            struct bench_result *r = &results[m][s];
+            uint32_t size = bench_sizes[s];
+
+            if (!r->valid)
+                continue;
+
+            snprintf(line, sizeof(line), "%4u %6.2f %7.1f%s",
+                size,
+                r->time ? (float)(size * BENCH_ITERATIONS) / r->time : 0.0f,
+                (float)r->time / BENCH_ITERATIONS,
+                r->ok ? "" : " FAIL");
+
+            pax_draw_text(pax_buffer, r->ok ? 0xffffffff : 0xffff0000, font, 9,
+                (s & 1) * 160, 24 + m * 44 + (s >> 1) * 10, line);
+        }
+    }
+
+    snprintf(line, sizeof(line), "wb pack %u B: bswap %.1f us, bytes %.1f us%s",
+        BENCH_MAX_SIZE,
+        (float)t_pack[0] / BENCH_ITERATIONS,
+        (float)t_pack[1] / BENCH_ITERATIONS,
+        pack_ok ? "" : " FAIL");
+    pax_draw_text(pax_buffer, pack_ok ? 0xffffffff : 0xffff0000, font, 9, 0, 240 - 22, line);
+
+    /* Pick the fastest TX mode that passed every integrity check */
+    turbo = turbo_ok && (t_tx[BENCH_TX_TURBO] < t_tx[BENCH_TX]);
+
+    snprintf(line, sizeof(line), "[A] use %s for FPGA link (now %s)  [B] back",
+        turbo ? "tx-turbo" : "tx", fpga_link_get_turbo() ? "tx-turbo" : "tx");
+    pax_draw_text(pax_buffer, 0xffffffff, font, 9, 0, 240 - 10, line);
+    ili9341_write(ili9341, pax_buffer->buf);
+
+    ice40_disable(ice40);
+
+    /* Applies to fpga_util and is restored from NVS on next FPGA use */
+    if (test_wait_for_response(NULL)) {
+        fpga_link_set_turbo(turbo);
+        nvs_set_u8_fixed("system", "fpga.turbo", turbo ? 1 : 0);
+    }
+
+    goto done;
+
+error:
+    ice40_disable(ice40);
+    test_wait_for_response(NULL);
+
+done:
+    free(data_rx);
+    free(data_tx);
+}
+
 void fpga_test(xQueueHandle buttonQueue, pax_buf_t* pax_buffer, ILI9341* ili9341) {
     run_fpga_tests(buttonQueue, pax_buffer, ili9341);
     test_wait_for_response(NULL);
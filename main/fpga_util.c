@@ -16,27 +16,246 @@
 #include <string.h>
 
 #include <esp_err.h>
+#include <esp_heap_caps.h>
+#include <esp_partition.h>
+#include <esp_timer.h>
 #include <driver/gpio.h>
+#include <soc/soc_memory_layout.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <freertos/ringbuf.h>
 #include <freertos/semphr.h>
+#include <freertos/task.h>
 
+#include "appfs.h"
 #include "ice40.h"
+#include "pax_gfx.h"
 #include "rp2040.h"
 
 #include "fpga_util.h"
 
 
+/* ---------------------------------------------------------------------------
+ * Link arbitration
+ * ------------------------------------------------------------------------ */
+
+/*
+ * Several tasks may talk to the FPGA (request processing, button reports,
+ * the async Wishbone engine, ...). Sequences that must not be interleaved
+ * (e.g. a command followed by its RESP_ACK read) are done with this held.
+ */
+
+static SemaphoreHandle_t g_link_lock;
+static StaticSemaphore_t g_link_lock_buf;
+static portMUX_TYPE      g_link_mux = portMUX_INITIALIZER_UNLOCKED;
+
+
+void
+fpga_link_lock(void)
+{
+    if (!g_link_lock) {
+        portENTER_CRITICAL(&g_link_mux);
+        if (!g_link_lock)
+            g_link_lock = xSemaphoreCreateMutexStatic(&g_link_lock_buf);
+        portEXIT_CRITICAL(&g_link_mux);
+    }
+
+    xSemaphoreTake(g_link_lock, portMAX_DELAY);
+}
+
+void
+fpga_link_unlock(void)
+{
+    xSemaphoreGive(g_link_lock);
+}
+
+/*
+ * TX-only transfers can go through the turbo path (higher SPI clock, no
+ * read back). Off by default, the SPI benchmark in the selftest menu turns
+ * it on once it verified the loopback is stable at that speed.
+ */
+
+static bool g_link_turbo;
+
+
+void
+fpga_link_set_turbo(bool turbo)
+{
+    g_link_turbo = turbo;
+}
+
+bool
+fpga_link_get_turbo(void)
+{
+    return g_link_turbo;
+}
+
+static esp_err_t
+_fpga_link_send(ICE40 *ice40, const uint8_t *data, size_t len)
+{
+    if (g_link_turbo)
+        return ice40_send_turbo(ice40, data, len);
+    else
+        return ice40_send(ice40, data, len);
+}
+
+
+/* ---------------------------------------------------------------------------
+ * Bitstream loading
+ * ------------------------------------------------------------------------ */
+
+/*
+ * Same sequence as ice40_load_bitstream() but split in three steps so the
+ * configuration data can be pushed to the FPGA as it arrives instead of
+ * requiring the whole image to be in RAM. The spi-ice40 component doesn't
+ * expose the individual steps, keep the timings below in sync with it.
+ */
+
+#define FPGA_CFG_RESET_MS   10      /* CRESET_B low with SPI_SS low */
+#define FPGA_CFG_CLEAR_MS   10      /* Configuration SRAM clear after reset */
+#define FPGA_CFG_DUMMY_LEN  16      /* Trailing clocks for the startup sequence */
+
+void
+fpga_bitstream_abort(ICE40 *ice40)
+{
+    // Hold in reset and give the SPI bus back
+    ice40_disable(ice40);
+    gpio_set_level(ice40->pin_cs, 1);
+}
+
+esp_err_t
+fpga_bitstream_begin(ICE40 *ice40)
+{
+    esp_err_t res;
+
+    // Hold the FPGA in reset with SPI_SS low to select slave SPI config
+    res = ice40_disable(ice40);
+    if (res != ESP_OK)
+        goto error;
+
+    gpio_set_level(ice40->pin_cs, 0);
+    vTaskDelay(pdMS_TO_TICKS(FPGA_CFG_RESET_MS));
+
+    // Release reset and leave time to clear the configuration SRAM
+    res = ice40_enable(ice40);
+    if (res != ESP_OK)
+        goto error;
+
+    vTaskDelay(pdMS_TO_TICKS(FPGA_CFG_CLEAR_MS));
+
+    return ESP_OK;
+
+error:
+    fpga_bitstream_abort(ice40);
+    return res;
+}
+
+esp_err_t
+fpga_bitstream_write(ICE40 *ice40, const uint8_t *data, size_t len)
+{
+    esp_err_t res;
+
+    res = ice40_send_turbo(ice40, data, len);
+    if (res != ESP_OK)
+        fpga_bitstream_abort(ice40);
+
+    return res;
+}
+
+esp_err_t
+fpga_bitstream_end(ICE40 *ice40)
+{
+    uint8_t dummy[FPGA_CFG_DUMMY_LEN];
+    esp_err_t res;
+    bool done;
+
+    // Extra clocks to let the FPGA start up
+    memset(dummy, 0x00, sizeof(dummy));
+
+    res = ice40_send_turbo(ice40, dummy, sizeof(dummy));
+
+    // Configuration is over either way, release SPI_SS
+    gpio_set_level(ice40->pin_cs, 1);
+
+    if (res != ESP_OK)
+        goto error;
+
+    // Check configuration succeeded
+    res = ice40_get_done(ice40, &done);
+    if (res != ESP_OK)
+        goto error;
+
+    if (!done) {
+        res = ESP_FAIL;
+        goto error;
+    }
+
+    return ESP_OK;
+
+error:
+    fpga_bitstream_abort(ice40);
+    return res;
+}
+
+
+/* ---------------------------------------------------------------------------
+ * Bitstream library
+ * ------------------------------------------------------------------------ */
+
+/*
+ * Bitstreams stored in AppFS next to the apps, named with FPGA_LIB_SUFFIX.
+ * They're configured straight from the memory mapped flash, without going
+ * through the SD card or a RAM copy.
+ */
+
+bool
+fpga_lib_is_bitstream(const char *name)
+{
+    size_t nl = strlen(name);
+    size_t sl = strlen(FPGA_LIB_SUFFIX);
+
+    return (nl > sl) && !strcmp(&name[nl - sl], FPGA_LIB_SUFFIX);
+}
+
+esp_err_t
+fpga_lib_load(ICE40 *ice40, const char *name)
+{
+    spi_flash_mmap_handle_t map;
+    appfs_handle_t fd;
+    const void *ptr;
+    esp_err_t res;
+    int size;
+
+    fd = appfsOpen(name);
+    if (fd == APPFS_INVALID_FD)
+        return ESP_ERR_NOT_FOUND;
+
+    appfsEntryInfo(fd, NULL, &size);
+
+    res = appfsMmap(fd, 0, size, &ptr, SPI_FLASH_MMAP_DATA, &map);
+    if (res != ESP_OK)
+        return res;
+
+    res = ice40_load_bitstream(ice40, ptr, size);
+
+    appfsMunmap(map);
+
+    return res;
+}
+
+
 /* ---------------------------------------------------------------------------
  * FPGA IRQ
  * ------------------------------------------------------------------------ */
 
 static SemaphoreHandle_t g_irq_trig;
+static volatile uint32_t g_irq_time;   /* Edge time (us, wraps) for latency stats */
 
 
 static void IRAM_ATTR
 fpga_irq_handler(void* arg)
 {
+    g_irq_time = (uint32_t)esp_timer_get_time();
     xSemaphoreGiveFromISR(g_irq_trig, NULL);
     portYIELD_FROM_ISR();
 }
@@ -48,11 +267,13 @@ fpga_irq_setup(ICE40 *ice40)
 
     // Setup semaphore
     g_irq_trig = xSemaphoreCreateBinary();
+    if (!g_irq_trig)
+        return ESP_ERR_NO_MEM;
 
     // Install handler
     res = gpio_isr_handler_add(ice40->pin_int, fpga_irq_handler, NULL);
     if (res != ESP_OK)
-        return res;
+        goto error_sem;
 
     // Configure GPIO
     gpio_config_t io_conf = {
@@ -65,9 +286,16 @@ fpga_irq_setup(ICE40 *ice40)
 
     res = gpio_config(&io_conf);
     if (res != ESP_OK)
-        return res;
+        goto error_isr;
 
     return ESP_OK;
+
+error_isr:
+    gpio_isr_handler_remove(ice40->pin_int);
+error_sem:
+    vSemaphoreDelete(g_irq_trig);
+    g_irq_trig = NULL;
+    return res;
 }
 
 void
@@ -96,52 +324,311 @@ fpga_irq_wait(TickType_t wait)
     return xSemaphoreTake(g_irq_trig, wait) == pdTRUE;
 }
 
+bool
+fpga_irq_add_to_set(QueueSetHandle_t set)
+{
+    return xQueueAddToSet(g_irq_trig, set) == pdPASS;
+}
+
+void
+fpga_irq_remove_from_set(QueueSetHandle_t set)
+{
+    // Removal fails while the semaphore is given, and the ISR may give
+    // it again between the two calls
+    do {
+        xSemaphoreTake(g_irq_trig, 0);
+    } while (xQueueRemoveFromSet(g_irq_trig, set) != pdPASS);
+}
+
+bool
+fpga_irq_is_member(QueueSetMemberHandle_t member)
+{
+    return member && (member == g_irq_trig);
+}
+
+
+/*
+ * Dispatcher: services register a handler for their request bit of the
+ * status byte. The task calling fpga_irq_dispatch() polls the status once
+ * and runs every pending handler, repeating until the FPGA has nothing
+ * left (or we've done enough for one round).
+ */
+
+#define FPGA_IRQ_MAX_ROUNDS 16
+
+static struct {
+    fpga_irq_handler_fn fn;
+    void *arg;
+} g_irq_handlers[FPGA_IRQ_SOURCES];
+
+static struct fpga_irq_stats g_irq_stats;
+
+
+esp_err_t
+fpga_irq_register(int src, fpga_irq_handler_fn fn, void *arg)
+{
+    if ((src < 0) || (src >= FPGA_IRQ_SOURCES))
+        return ESP_ERR_INVALID_ARG;
+
+    if (fn && g_irq_handlers[src].fn)
+        return ESP_ERR_INVALID_STATE;
+
+    g_irq_handlers[src].fn  = fn;
+    g_irq_handlers[src].arg = arg;
+
+    return ESP_OK;
+}
+
+void
+fpga_irq_unregister(int src)
+{
+    if ((src >= 0) && (src < FPGA_IRQ_SOURCES))
+        g_irq_handlers[src].fn = NULL;
+}
+
+void
+fpga_irq_get_stats(struct fpga_irq_stats *stats)
+{
+    *stats = g_irq_stats;
+}
+
+bool
+fpga_irq_dispatch(ICE40 *ice40, TickType_t wait, esp_err_t *err)
+{
+    esp_err_t res;
+    uint8_t buf[2];
+    uint8_t req;
+
+    // Default is no error
+    *err = ESP_OK;
+
+    // If the FPGA isn't requesting anything ... we have nothing to do !
+    if (!fpga_irq_wait(wait))
+        return false;
+
+    // Latency from edge to service
+    uint32_t lat = (uint32_t)esp_timer_get_time() - g_irq_time;
+
+    g_irq_stats.irqs++;
+    g_irq_stats.lat_sum += lat;
+    if (lat > g_irq_stats.lat_max)
+        g_irq_stats.lat_max = lat;
+
+    int n;
+
+    for (n=0; n<FPGA_IRQ_MAX_ROUNDS; n++)
+    {
+        // Poll status byte to see what's up
+        buf[0] = SPI_CMD_NOP2;
+        fpga_link_lock();
+        res = ice40_transaction(ice40, buf, 2, buf, 2);
+        fpga_link_unlock();
+        if (res != ESP_OK)
+            goto error;
+
+        g_irq_stats.polls++;
+
+        req = buf[1] & SPI_REQ_MASK;
+        if (!req)
+            break;
+
+        // Run all pending handlers
+        bool handled = false;
+
+        for (int src=0; src<FPGA_IRQ_SOURCES; src++)
+        {
+            if (!(req & (1 << src)) || !g_irq_handlers[src].fn)
+                continue;
+
+            res = g_irq_handlers[src].fn(ice40, g_irq_handlers[src].arg);
+            if (res != ESP_OK)
+                goto error;
+
+            g_irq_stats.served[src]++;
+            handled = true;
+        }
+
+        // Nothing we know how to handle (anymore)
+        if (!handled) {
+            g_irq_stats.unhandled++;
+            break;
+        }
+    }
+
+    // Round limit hit with requests possibly still pending. The IRQ is
+    // edge triggered and won't fire again for those, so re-arm ourselves
+    // to come back after the caller had a chance to do other things.
+    if (n == FPGA_IRQ_MAX_ROUNDS) {
+        g_irq_time = (uint32_t)esp_timer_get_time();
+        xSemaphoreGive(g_irq_trig);
+    }
+
+    // Done !
+    return true;
+
+error:
+    *err = res;
+    return false;
+}
+
 
 /* ---------------------------------------------------------------------------
  * Wishbone bridge
  * ------------------------------------------------------------------------ */
 
-struct fpga_wb_cmdbuf {
-    bool       done;
-    uint8_t   *buf;
-    int        len;
-    int        used;
-    int        rd_cnt;
-    uint32_t **rd_ptr;
-};
+struct fpga_wb_cmdbuf *
+fpga_wb_init(struct fpga_wb_cmdbuf *cb, uint8_t *buf, int len, uint32_t **rd_ptr, int rd_max)
+{
+    cb->buf    = buf;
+    cb->len    = len;
+    cb->rd_ptr = rd_ptr;
+    cb->rd_max = rd_max;
+
+    fpga_wb_reset(cb);
+
+    return cb;
+}
+
+void
+fpga_wb_reset(struct fpga_wb_cmdbuf *cb)
+{
+    cb->buf[0] = SPI_CMD_WISHBONE;
+    cb->used   = 1;
+    cb->rd_cnt = 0;
+    cb->done   = false;
+}
 
 struct fpga_wb_cmdbuf *
 fpga_wb_alloc(int n)
 {
     struct fpga_wb_cmdbuf *cb;
+    uint8_t *mem;
+    int len;
 
     if (n > 511)
         return NULL;
 
-    cb = calloc(1, sizeof(struct fpga_wb_cmdbuf));
+    // Single allocation for everything: header, read pointers, buffer
+    len = 1 + (n * 8 * sizeof(uint32_t));
 
-    cb->len  = 1 + (n * 8 * sizeof(uint32_t));
-
-    cb->buf = malloc(cb->len);
-    cb->rd_ptr = malloc(64 * sizeof(uint32_t*));
+    mem = malloc(sizeof(struct fpga_wb_cmdbuf) + FPGA_WB_MAX_READS * sizeof(uint32_t*) + len);
+    if (!mem)
+        return NULL;
 
-    cb->buf[0] = SPI_CMD_WISHBONE;
-    cb->used = 1;
+    cb = (struct fpga_wb_cmdbuf *)mem;
+    mem += sizeof(struct fpga_wb_cmdbuf);
 
-    return cb;
+    return fpga_wb_init(cb,
+        mem + FPGA_WB_MAX_READS * sizeof(uint32_t*), len,
+        (uint32_t **)mem, FPGA_WB_MAX_READS
+    );
 }
 
 void
 fpga_wb_free(struct fpga_wb_cmdbuf *cb)
 {
-    if (!cb)
-        return;
-
-    free(cb->buf);
-    free(cb->rd_ptr);
     free(cb);
 }
 
+/*
+ * Big-endian word packing. The wishbone data is sent MSB first so on
+ * the (little-endian) ESP32 each word is byte swapped and copied as a
+ * whole instead of being assembled byte by byte. memcpy() is used since
+ * the buffer positions are not word aligned (1 command byte + 3 address
+ * bytes header).
+ */
+
+static inline void
+_fpga_wb_put_be32(uint8_t *dst, const uint32_t *src, int n)
+{
+    while (n--) {
+        uint32_t w = __builtin_bswap32(*src++);
+        memcpy(dst, &w, 4);
+        dst += 4;
+    }
+}
+
+static inline void
+_fpga_wb_get_be32(uint32_t *dst, const uint8_t *src, int n)
+{
+    while (n--) {
+        uint32_t w;
+        memcpy(&w, src, 4);
+        *dst++ = __builtin_bswap32(w);
+        src += 4;
+    }
+}
+
+// Byte by byte reference for fpga_wb_pack_bench()
+static void
+_fpga_wb_put_be32_bytes(uint8_t *dst, const uint32_t *src, int n)
+{
+    while (n--) {
+        uint32_t w = *src++;
+        *dst++ = w >> 24;
+        *dst++ = w >> 16;
+        *dst++ = w >>  8;
+        *dst++ = w;
+    }
+}
+
+static void
+_fpga_wb_get_be32_bytes(uint32_t *dst, const uint8_t *src, int n)
+{
+    while (n--) {
+        *dst++ = ((uint32_t)src[0] << 24) | ((uint32_t)src[1] << 16) |
+                 ((uint32_t)src[2] <<  8) |  (uint32_t)src[3];
+        src += 4;
+    }
+}
+
+bool
+fpga_wb_pack_bench(int n, int rounds, int64_t *t_bswap, int64_t *t_bytes)
+{
+    uint32_t *src, *dst;
+    uint8_t *buf;
+    int64_t t;
+    bool ok;
+
+    // Same unaligned layout as a command buffer (1 byte header)
+    src = malloc(n * 4);
+    dst = malloc(n * 4);
+    buf = malloc(n * 4 + 1);
+
+    ok = src && dst && buf;
+    if (!ok)
+        goto done;
+
+    for (int i = 0; i < n; i++)
+        src[i] = 0x01020304 * (i + 1);
+
+    t = esp_timer_get_time();
+    for (int r = 0; r < rounds; r++) {
+        _fpga_wb_put_be32(&buf[1], src, n);
+        _fpga_wb_get_be32(dst, &buf[1], n);
+    }
+    *t_bswap = esp_timer_get_time() - t;
+
+    ok &= !memcmp(src, dst, n * 4);
+    memset(dst, 0x00, n * 4);
+
+    t = esp_timer_get_time();
+    for (int r = 0; r < rounds; r++) {
+        _fpga_wb_put_be32_bytes(&buf[1], src, n);
+        _fpga_wb_get_be32_bytes(dst, &buf[1], n);
+    }
+    *t_bytes = esp_timer_get_time() - t;
+
+    ok &= !memcmp(src, dst, n * 4);
+
+done:
+    free(buf);
+    free(dst);
+    free(src);
+
+    return ok;
+}
+
 bool
 fpga_wb_queue_write(struct fpga_wb_cmdbuf *cb,
                     int dev, uint32_t addr, uint32_t val)
@@ -161,10 +648,8 @@ fpga_wb_queue_write(struct fpga_wb_cmdbuf *cb,
     cb->buf[cb->used++] = (addr >>  2) & 0xff;
 
     // Data
-    cb->buf[cb->used++] = (val >> 24) & 0xff;
-    cb->buf[cb->used++] = (val >> 16) & 0xff;
-    cb->buf[cb->used++] = (val >>  8) & 0xff;
-    cb->buf[cb->used++] = (val      ) & 0xff;
+    _fpga_wb_put_be32(&cb->buf[cb->used], &val, 1);
+    cb->used += 4;
 
     // Done
     return true;
@@ -179,7 +664,7 @@ fpga_wb_queue_read(struct fpga_wb_cmdbuf *cb,
         return false;
     if ((cb->len - cb->used) < 8)
         return false;
-    if (cb->rd_cnt >= 64)
+    if (cb->rd_cnt >= cb->rd_max)
         return false;
 
     // Dev sel & Mode (Write, Re-Address)
@@ -191,10 +676,8 @@ fpga_wb_queue_read(struct fpga_wb_cmdbuf *cb,
     cb->buf[cb->used++] = (addr >>  2) & 0xff;
 
     // Data
-    cb->buf[cb->used++] = 0x00;
-    cb->buf[cb->used++] = 0x00;
-    cb->buf[cb->used++] = 0x00;
-    cb->buf[cb->used++] = 0x00;
+    memset(&cb->buf[cb->used], 0x00, 4);
+    cb->used += 4;
     cb->rd_ptr[cb->rd_cnt++] = val;
 
     // Done
@@ -220,13 +703,8 @@ fpga_wb_queue_write_burst(struct fpga_wb_cmdbuf *cb,
     cb->buf[cb->used++] = (addr >>  2) & 0xff;
 
     // Data
-    while (n--) {
-        cb->buf[cb->used++] = (*val >> 24) & 0xff;
-        cb->buf[cb->used++] = (*val >> 16) & 0xff;
-        cb->buf[cb->used++] = (*val >>  8) & 0xff;
-        cb->buf[cb->used++] = (*val      ) & 0xff;
-        val++;
-    }
+    _fpga_wb_put_be32(&cb->buf[cb->used], val, n);
+    cb->used += 4 * n;
 
     // Done (for good !)
     cb->done = true;
@@ -242,7 +720,7 @@ fpga_wb_queue_read_burst(struct fpga_wb_cmdbuf *cb,
         return false;
     if ((cb->len - cb->used) < (4 * (n+1)))
         return false;
-    if ((cb->rd_cnt + n) > 64)
+    if ((cb->rd_cnt + n) > cb->rd_max)
         return false;
 
     // Dev sel & Mode (Write, Burst)
@@ -254,28 +732,25 @@ fpga_wb_queue_read_burst(struct fpga_wb_cmdbuf *cb,
     cb->buf[cb->used++] = (addr >>  2) & 0xff;
 
     // Data
-    while (n--) {
-        cb->buf[cb->used++] = 0x00;
-        cb->buf[cb->used++] = 0x00;
-        cb->buf[cb->used++] = 0x00;
-        cb->buf[cb->used++] = 0x00;
-        cb->rd_ptr[cb->rd_cnt++] = val;
-        val++;
-    }
+    memset(&cb->buf[cb->used], 0x00, 4 * n);
+    cb->used += 4 * n;
+
+    while (n--)
+        cb->rd_ptr[cb->rd_cnt++] = val++;
 
     // Done (for good !)
     cb->done = true;
     return true;
 }
 
-bool
-fpga_wb_exec(struct fpga_wb_cmdbuf *cb, ICE40* ice40)
+static bool
+_fpga_wb_exec(struct fpga_wb_cmdbuf *cb, ICE40* ice40)
 {
     esp_err_t res;
     int l;
 
     // Execute transmit transaction with the request
-    res = ice40_send(ice40, cb->buf, cb->used);
+    res = _fpga_link_send(ice40, cb->buf, cb->used);
     if (res != ESP_OK)
         return false;
 
@@ -291,111 +766,574 @@ fpga_wb_exec(struct fpga_wb_cmdbuf *cb, ICE40* ice40)
     if (res != ESP_OK)
         return false;
 
-    // Fill data to requester
-    for (int i=0; i<cb->rd_cnt; i++) {
-        *(cb->rd_ptr[i]) = (
-            (cb->buf[4*i+2] << 24) |
-            (cb->buf[4*i+3] << 16) |
-            (cb->buf[4*i+4] <<  8) |
-            (cb->buf[4*i+5])
-        );
+    // Fill data to requester, runs of contiguous destinations (bursts)
+    // are unpacked in one go
+    for (int i=0; i<cb->rd_cnt; ) {
+        int j = i + 1;
+
+        while ((j < cb->rd_cnt) && (cb->rd_ptr[j] == (cb->rd_ptr[j-1] + 1)))
+            j++;
+
+        _fpga_wb_get_be32(cb->rd_ptr[i], &cb->buf[4*i+2], j - i);
+        i = j;
     }
 
     return true;
 }
 
+bool
+fpga_wb_exec(struct fpga_wb_cmdbuf *cb, ICE40* ice40)
+{
+    bool ok;
+
+    fpga_link_lock();
+    ok = _fpga_wb_exec(cb, ice40);
+    fpga_link_unlock();
+
+    return ok;
+}
+
+
+/*
+ * Bulk transfers: arbitrary length, split in maximum sized bursts. Data
+ * is packed/unpacked directly from/to the caller array.
+ */
+
+#define FPGA_WB_BULK_WORDS  1020    /* Keeps each transaction under 4k */
+
+static bool
+_fpga_wb_bulk(ICE40 *ice40, int dev, uint32_t addr, uint32_t *val, int n, bool inc, bool write)
+{
+    uint8_t *buf;
+    bool ok = true;
+
+    buf = heap_caps_malloc(5 + 4 * ((n < FPGA_WB_BULK_WORDS) ? n : FPGA_WB_BULK_WORDS), MALLOC_CAP_DMA);
+    if (!buf)
+        return false;
+
+    while (n > 0)
+    {
+        int cnt = (n < FPGA_WB_BULK_WORDS) ? n : FPGA_WB_BULK_WORDS;
+        int l = 0;
+
+        // Command, Dev sel & Mode (Burst), Address
+        buf[l++] = SPI_CMD_WISHBONE;
+        buf[l++] = (write ? 0x80 : 0x00) | (inc ? 0x20 : 0x00) | (dev & 0xf);
+        buf[l++] = (addr >> 18) & 0xff;
+        buf[l++] = (addr >> 10) & 0xff;
+        buf[l++] = (addr >>  2) & 0xff;
+
+        // Data
+        if (write)
+            _fpga_wb_put_be32(&buf[l], val, cnt);
+        else
+            memset(&buf[l], 0x00, 4 * cnt);
+        l += 4 * cnt;
+
+        fpga_link_lock();
+
+        ok = (_fpga_link_send(ice40, buf, l) == ESP_OK);
+
+        // Read data back
+        if (ok && !write) {
+            l = 2 + (4 * cnt);
+            buf[0] = SPI_CMD_RESP_ACK;
+
+            ok = (ice40_transaction(ice40, buf, l, buf, l) == ESP_OK);
+        }
+
+        fpga_link_unlock();
+
+        if (!ok)
+            break;
+
+        if (!write)
+            _fpga_wb_get_be32(val, &buf[2], cnt);
+
+        // Next
+        val += cnt;
+        n   -= cnt;
+        if (inc)
+            addr += 4 * cnt;
+    }
+
+    free(buf);
+
+    return ok;
+}
+
+bool
+fpga_wb_write_bulk(ICE40 *ice40, int dev, uint32_t addr, const uint32_t *val, int n, bool inc)
+{
+    return _fpga_wb_bulk(ice40, dev, addr, (uint32_t *)val, n, inc, true);
+}
+
+bool
+fpga_wb_read_bulk(ICE40 *ice40, int dev, uint32_t addr, uint32_t *val, int n, bool inc)
+{
+    return _fpga_wb_bulk(ice40, dev, addr, val, n, inc, false);
+}
+
+
+/*
+ * Asynchronous execution: command buffers submitted from any task are
+ * executed back-to-back by a service task, completion is signaled through
+ * a callback (called from the service task, after it released the link) or,
+ * if none is given, a task notification to the submitter (see fpga_wb_wait).
+ */
+
+#define FPGA_WB_QUEUE_LEN   16
+
+struct fpga_wb_job {
+    struct fpga_wb_cmdbuf *cb;
+    fpga_wb_done_fn        done;
+    void                  *arg;
+    TaskHandle_t           notify;
+};
+
+static struct {
+    ICE40            *ice40;
+    QueueHandle_t     queue;
+    TaskHandle_t      task;
+    SemaphoreHandle_t exited;   /* Given by the task once it stopped */
+} g_wb_async;
+
+
+static void
+_fpga_wb_complete(struct fpga_wb_job *job, bool ok)
+{
+    if (job->done)
+        job->done(job->cb, ok, job->arg);
+    else if (job->notify)
+        xTaskNotifyGive(job->notify);
+}
+
+static void
+_fpga_wb_async_task(void *arg)
+{
+    struct fpga_wb_job job[FPGA_WB_QUEUE_LEN];
+    bool ok[FPGA_WB_QUEUE_LEN];
+    bool stop = false;
+    int n;
+
+    while (!stop) {
+        // Wait for work
+        xQueueReceive(g_wb_async.queue, &job[0], portMAX_DELAY);
+
+        // Execute everything queued while we own the link. A job without
+        // command buffer is the stop request from fpga_wb_async_stop().
+        fpga_link_lock();
+
+        n = 0;
+        do {
+            if (!job[n].cb) {
+                stop = true;
+                break;
+            }
+            job[n].cb->done = true;
+            ok[n] = _fpga_wb_exec(job[n].cb, g_wb_async.ice40);
+            n++;
+        } while ((n < FPGA_WB_QUEUE_LEN) && (xQueueReceive(g_wb_async.queue, &job[n], 0) == pdTRUE));
+
+        fpga_link_unlock();
+
+        // Completions run without the link held, callbacks are free to
+        // use it (the link lock isn't recursive)
+        for (int i=0; i<n; i++)
+            _fpga_wb_complete(&job[i], ok[i]);
+    }
+
+    xSemaphoreGive(g_wb_async.exited);
+    vTaskDelete(NULL);
+}
+
+esp_err_t
+fpga_wb_async_start(ICE40 *ice40)
+{
+    if (g_wb_async.task)
+        return ESP_ERR_INVALID_STATE;
+
+    g_wb_async.ice40 = ice40;
+    g_wb_async.queue  = xQueueCreate(FPGA_WB_QUEUE_LEN, sizeof(struct fpga_wb_job));
+    g_wb_async.exited = xSemaphoreCreateBinary();
+    if (!g_wb_async.queue || !g_wb_async.exited)
+        goto error;
+
+    if (xTaskCreate(_fpga_wb_async_task, "fpga_wb", 3072, NULL, uxTaskPriorityGet(NULL) + 1, &g_wb_async.task) != pdPASS)
+        goto error;
+
+    return ESP_OK;
+
+error:
+    if (g_wb_async.queue)
+        vQueueDelete(g_wb_async.queue);
+    if (g_wb_async.exited)
+        vSemaphoreDelete(g_wb_async.exited);
+    memset(&g_wb_async, 0x00, sizeof(g_wb_async));
+    return ESP_ERR_NO_MEM;
+}
+
+void
+fpga_wb_async_stop(void)
+{
+    struct fpga_wb_job job = { .cb = NULL };
+
+    if (!g_wb_async.task)
+        return;
+
+    // Queue a stop request behind pending jobs, so that everything
+    // dequeued before it still runs to completion, and wait for the task
+    xQueueSend(g_wb_async.queue, &job, portMAX_DELAY);
+    xSemaphoreTake(g_wb_async.exited, portMAX_DELAY);
+
+    // Fail whatever got queued after the stop request
+    while (xQueueReceive(g_wb_async.queue, &job, 0) == pdTRUE)
+        if (job.cb)
+            _fpga_wb_complete(&job, false);
+
+    vQueueDelete(g_wb_async.queue);
+    vSemaphoreDelete(g_wb_async.exited);
+
+    memset(&g_wb_async, 0x00, sizeof(g_wb_async));
+}
+
+bool
+fpga_wb_submit(struct fpga_wb_cmdbuf *cb, fpga_wb_done_fn done, void *arg)
+{
+    struct fpga_wb_job job = {
+        .cb     = cb,
+        .done   = done,
+        .arg    = arg,
+        .notify = done ? NULL : xTaskGetCurrentTaskHandle(),
+    };
+    TickType_t wait;
+
+    if (!g_wb_async.queue || !cb)
+        return false;
+
+    // From a completion callback, waiting for room would never end
+    wait = (xTaskGetCurrentTaskHandle() == g_wb_async.task) ? 0 : portMAX_DELAY;
+
+    return xQueueSend(g_wb_async.queue, &job, wait) == pdTRUE;
+}
+
+bool
+fpga_wb_wait(TickType_t wait)
+{
+    return ulTaskNotifyTake(pdFALSE, wait) != 0;
+}
 
 /* ---------------------------------------------------------------------------
  * Button reports
  * ------------------------------------------------------------------------ */
 
+/*
+ * All queued input messages are merged into a single report: the current
+ * state and the mask of everything that changed since the last report.
+ * Optionally, the state is also reported at a fixed rate (with an empty
+ * change mask if nothing happened) so gateware can sample it per frame.
+ */
+
 static uint16_t g_btn_state = 0;
+static uint32_t g_btn_period;   /* us, 0 = only report changes */
+static int64_t  g_btn_next;
 
 void
 fpga_btn_reset(void)
 {
-    g_btn_state = 0;
+    g_btn_state  = 0;
+    g_btn_period = 0;
+}
+
+void
+fpga_btn_set_period(uint32_t period_ms)
+{
+    g_btn_period = period_ms * 1000;
+    g_btn_next   = esp_timer_get_time() + g_btn_period;
+}
+
+uint16_t
+fpga_btn_get_state(void)
+{
+    return g_btn_state;
+}
+
+int64_t
+fpga_btn_next_report(void)
+{
+    return g_btn_period ? g_btn_next : INT64_MAX;
+}
+
+uint16_t
+fpga_btn_apply(const rp2040_input_message_t *msg)
+{
+    uint16_t btn_mask = 0;
+
+    switch(msg->input) {
+        case RP2040_INPUT_JOYSTICK_DOWN:
+            btn_mask = 1 << 0;
+            break;
+        case RP2040_INPUT_JOYSTICK_UP:
+            btn_mask = 1 << 1;
+            break;
+        case RP2040_INPUT_JOYSTICK_LEFT:
+            btn_mask = 1 << 2;
+            break;
+        case RP2040_INPUT_JOYSTICK_RIGHT:
+            btn_mask = 1 << 3;
+            break;
+        case RP2040_INPUT_JOYSTICK_PRESS:
+            btn_mask = 1 << 4;
+            break;
+        case RP2040_INPUT_BUTTON_HOME:
+            btn_mask = 1 << 5;
+            break;
+        case RP2040_INPUT_BUTTON_MENU:
+            btn_mask = 1 << 6;
+            break;
+        case RP2040_INPUT_BUTTON_SELECT:
+            btn_mask = 1 << 7;
+            break;
+        case RP2040_INPUT_BUTTON_START:
+            btn_mask = 1 << 8;
+            break;
+        case RP2040_INPUT_BUTTON_ACCEPT:
+            btn_mask = 1 << 9;
+            break;
+        case RP2040_INPUT_BUTTON_BACK:
+            btn_mask = 1 << 10;
+        default:
+            break;
+    }
+
+    if (msg->state)
+        g_btn_state |=  btn_mask;
+    else
+        g_btn_state &= ~btn_mask;
+
+    return btn_mask;
 }
 
 bool
-fpga_btn_forward_events(ICE40 *ice40, xQueueHandle buttonQueue, esp_err_t *err)
+fpga_btn_report(ICE40 *ice40, uint16_t btn_changed, esp_err_t *err)
 {
-    rp2040_input_message_t buttonMessage;
-    bool work_done = false;
+    int64_t now;
 
     if (err)
         *err = ESP_OK;
 
+    // Anything to report ?
+    now = esp_timer_get_time();
+
+    if (!btn_changed && !(g_btn_period && (now >= g_btn_next)))
+        return false;
+
+    if (g_btn_period)
+        g_btn_next = now + g_btn_period;
+
+    uint8_t spi_message[5] = {
+        SPI_CMD_BUTTON_REPORT,
+        g_btn_state >> 8,
+        g_btn_state & 0xff,
+        btn_changed >> 8,
+        btn_changed & 0xff,
+    };
+
+    fpga_link_lock();
+    esp_err_t res = _fpga_link_send(ice40, spi_message, 5);
+    fpga_link_unlock();
+
+    if ((res != ESP_OK) && err)
+        *err = res;
+
+    return true;
+}
+
+bool
+fpga_btn_forward_events(ICE40 *ice40, xQueueHandle buttonQueue, esp_err_t *err)
+{
+    rp2040_input_message_t buttonMessage;
+    uint16_t btn_changed = 0;
+
     while (xQueueReceive(buttonQueue, &buttonMessage, 0) == pdTRUE)
+        btn_changed |= fpga_btn_apply(&buttonMessage);
+
+    return fpga_btn_report(ice40, btn_changed, err);
+}
+
+
+/* ---------------------------------------------------------------------------
+ * LCD passthrough
+ * ------------------------------------------------------------------------ */
+
+/*
+ * Each SPI_CMD_LCD_PASSTHROUGH transaction carries a flag byte (D/C level)
+ * followed by bytes forwarded as-is to the ILI9341, so the ESP32 can keep
+ * drawing while the FPGA owns the LCD bus. Pixel data is staged through a
+ * DMA capable bounce buffer since frame buffers usually live in PSRAM.
+ * Pixels are RGB565, big endian, exactly as pax renders them for the LCD.
+ */
+
+#define FPGA_LCD_CHUNK_SIZE 4096
+
+#define ILI9341_CASET       0x2a
+#define ILI9341_PASET       0x2b
+#define ILI9341_RAMWR       0x2c
+
+
+static esp_err_t
+_fpga_lcd_send(ICE40 *ice40, uint8_t *buf, size_t len)
+{
+    esp_err_t res;
+
+    fpga_link_lock();
+    res = _fpga_link_send(ice40, buf, len);
+    fpga_link_unlock();
+
+    return res;
+}
+
+esp_err_t
+fpga_lcd_write(ICE40 *ice40, bool dc, const uint8_t *data, size_t len)
+{
+    uint8_t small[8] __attribute__((aligned(4)));
+    uint8_t *buf;
+    esp_err_t res = ESP_OK;
+
+    // Commands and their arguments are tiny, no need to hit the heap
+    if (len <= (sizeof(small) - 2))
+        buf = small;
+    else if (!(buf = heap_caps_malloc(FPGA_LCD_CHUNK_SIZE, MALLOC_CAP_DMA)))
+        return ESP_ERR_NO_MEM;
+
+    while (len && (res == ESP_OK))
     {
-        uint8_t  pin   = buttonMessage.input;
-        bool     value = buttonMessage.state;
-        uint16_t btn_mask = 0;
+        size_t l = (len < (FPGA_LCD_CHUNK_SIZE - 2)) ? len : (FPGA_LCD_CHUNK_SIZE - 2);
 
-        switch(pin) {
-            case RP2040_INPUT_JOYSTICK_DOWN:
-                btn_mask = 1 << 0;
-                break;
-            case RP2040_INPUT_JOYSTICK_UP:
-                btn_mask = 1 << 1;
-                break;
-            case RP2040_INPUT_JOYSTICK_LEFT:
-                btn_mask = 1 << 2;
-                break;
-            case RP2040_INPUT_JOYSTICK_RIGHT:
-                btn_mask = 1 << 3;
-                break;
-            case RP2040_INPUT_JOYSTICK_PRESS:
-                btn_mask = 1 << 4;
-                break;
-            case RP2040_INPUT_BUTTON_HOME:
-                btn_mask = 1 << 5;
-                break;
-            case RP2040_INPUT_BUTTON_MENU:
-                btn_mask = 1 << 6;
-                break;
-            case RP2040_INPUT_BUTTON_SELECT:
-                btn_mask = 1 << 7;
-                break;
-            case RP2040_INPUT_BUTTON_START:
-                btn_mask = 1 << 8;
-                break;
-            case RP2040_INPUT_BUTTON_ACCEPT:
-                btn_mask = 1 << 9;
-                break;
-            case RP2040_INPUT_BUTTON_BACK:
-                btn_mask = 1 << 10;
-            default:
-                break;
+        buf[0] = SPI_CMD_LCD_PASSTHROUGH;
+        buf[1] = dc ? FPGA_LCD_DC_DATA : FPGA_LCD_DC_CMD;
+        memcpy(&buf[2], data, l);
+
+        res = _fpga_lcd_send(ice40, buf, l + 2);
+
+        data += l;
+        len  -= l;
+    }
+
+    if (buf != small)
+        free(buf);
+
+    return res;
+}
+
+static esp_err_t
+_fpga_lcd_cmd(ICE40 *ice40, uint8_t cmd, const uint8_t *arg, size_t len)
+{
+    esp_err_t res;
+
+    res = fpga_lcd_write(ice40, false, &cmd, 1);
+    if ((res == ESP_OK) && len)
+        res = fpga_lcd_write(ice40, true, arg, len);
+
+    return res;
+}
+
+esp_err_t
+fpga_lcd_blit(ICE40 *ice40, const pax_buf_t *pax_buffer, int x, int y, int w, int h)
+{
+    const uint8_t *src;
+    uint8_t win[4];
+    uint8_t *buf;
+    int rows, stride;
+    esp_err_t res;
+
+    // The LCD takes RGB565 as-is, nothing else can be sent without converting
+    if (pax_buffer->type != PAX_BUF_16_565RGB)
+        return ESP_ERR_NOT_SUPPORTED;
+
+    // Clip
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if ((x + w) > pax_buffer->width)
+        w = pax_buffer->width - x;
+    if ((y + h) > pax_buffer->height)
+        h = pax_buffer->height - y;
+    if ((w <= 0) || (h <= 0))
+        return ESP_OK;
+
+    // Set window and start memory write
+    win[0] = x >> 8; win[1] = x & 0xff; win[2] = (x + w - 1) >> 8; win[3] = (x + w - 1) & 0xff;
+    res = _fpga_lcd_cmd(ice40, ILI9341_CASET, win, 4);
+    if (res != ESP_OK)
+        return res;
+
+    win[0] = y >> 8; win[1] = y & 0xff; win[2] = (y + h - 1) >> 8; win[3] = (y + h - 1) & 0xff;
+    res = _fpga_lcd_cmd(ice40, ILI9341_PASET, win, 4);
+    if (res != ESP_OK)
+        return res;
+
+    res = _fpga_lcd_cmd(ice40, ILI9341_RAMWR, NULL, 0);
+    if (res != ESP_OK)
+        return res;
+
+    // Send as many full rows per transaction as fit
+    buf = heap_caps_malloc(FPGA_LCD_CHUNK_SIZE, MALLOC_CAP_DMA);
+    if (!buf)
+        return ESP_ERR_NO_MEM;
+
+    stride = pax_buffer->width * 2;
+    src    = (const uint8_t *)pax_buffer->buf + (y * stride) + (x * 2);
+    rows   = (FPGA_LCD_CHUNK_SIZE - 2) / (w * 2);
+
+    buf[0] = SPI_CMD_LCD_PASSTHROUGH;
+    buf[1] = FPGA_LCD_DC_DATA;
+
+    // Rows wider than one transaction are sent in pieces
+    while ((h > 0) && !rows)
+    {
+        for (int ofs=0; ofs < (w * 2); ofs += FPGA_LCD_CHUNK_SIZE - 2) {
+            int l = (w * 2) - ofs;
+            if (l > (FPGA_LCD_CHUNK_SIZE - 2))
+                l = FPGA_LCD_CHUNK_SIZE - 2;
+
+            memcpy(&buf[2], &src[ofs], l);
+
+            res = _fpga_lcd_send(ice40, buf, 2 + l);
+            if (res != ESP_OK)
+                goto done;
         }
 
-        if (btn_mask != 0)
-        {
-            work_done = true;
-
-            if (value)
-                g_btn_state |=  btn_mask;
-            else
-                g_btn_state &= ~btn_mask;
-
-            uint8_t spi_message[5] = {
-                SPI_CMD_BUTTON_REPORT,
-                g_btn_state >> 8,
-                g_btn_state & 0xff,
-                btn_mask >> 8,
-                btn_mask & 0xff,
-            };
-
-            esp_err_t res = ice40_send(ice40, spi_message, 5);
-            if (res != ESP_OK) {
-                if (err)
-                    *err = res;
-                return work_done;
+        src += stride;
+        h--;
+    }
+
+    while (h > 0)
+    {
+        int n = (h < rows) ? h : rows;
+        uint8_t *dst = &buf[2];
+
+        if (w == pax_buffer->width) {
+            memcpy(dst, src, n * stride);
+            src += n * stride;
+        } else {
+            for (int i=0; i<n; i++) {
+                memcpy(dst, src, w * 2);
+                dst += w * 2;
+                src += stride;
             }
         }
+
+        res = _fpga_lcd_send(ice40, buf, 2 + (n * w * 2));
+        if (res != ESP_OK)
+            break;
+
+        h -= n;
     }
 
-    return work_done;
+done:
+    free(buf);
+
+    return res;
 }
 
 
@@ -403,18 +1341,548 @@ fpga_btn_forward_events(ICE40 *ice40, xQueueHandle buttonQueue, esp_err_t *err)
  * Request processing
  * ------------------------------------------------------------------------ */
 
+/*
+ * Entries are kept in a hash table indexed by fid. File entries only keep
+ * their FILE* open while they're in the open files LRU, since the SD card
+ * mount only allows a handful of open files. They get reopened as needed.
+ * Lookups of fids without any file are remembered as empty entries so we
+ * don't hit the filesystem on every request. Only the most recent ones are
+ * kept, so the FPGA asking for many unknown fids can't grow the table.
+ */
+
+#define FPGA_REQ_HASH_BITS  6
+#define FPGA_REQ_HASH_SIZE  (1 << FPGA_REQ_HASH_BITS)
+#define FPGA_REQ_MAX_OPEN   3
+#define FPGA_REQ_MAX_EMPTY  32
+
+struct req_cache;
+
 struct req_entry {
-    struct req_entry *next;
+    struct req_entry *next;     /* Hash bucket chain */
 
     uint32_t fid;
-    FILE   * fh;
-    void   * data;
+    char   * path;              /* File entries */
+    FILE   * fh;                /*  NULL when closed by the LRU */
+    void   * data;              /* Raw data / memory mapped entries */
     size_t   len;
     size_t   ofs;
+
+    bool     mapped;            /* Data is memory mapped flash (read-only) */
+    bool     map_appfs;
+    spi_flash_mmap_handle_t map;
+
+    struct req_entry *lru_prev; /* Open files LRU */
+    struct req_entry *lru_next;
+
+    struct req_cache *cache;
 };
 
-struct req_entry *g_req_entries;
+static struct req_entry *g_req_hash[FPGA_REQ_HASH_SIZE];
+static struct req_entry *g_req_lru_head;    /* Most recently used */
+static struct req_entry *g_req_lru_tail;
+static int               g_req_open_cnt;
+static uint32_t          g_req_empty[FPGA_REQ_MAX_EMPTY];  /* fids of empty entries, oldest first */
+static int               g_req_empty_cnt;
+
+
+/*
+ * FREAD / FWRITE data is transferred through buffers taken from a small
+ * pool of DMA capable internal RAM, allocated once at setup and large
+ * enough for the largest possible request (64k + command / status bytes).
+ * If the pool is empty (or couldn't be allocated), we fall back to the heap.
+ */
+
+#define FPGA_REQ_BUF_SIZE   (2 + 65536)
+#define FPGA_REQ_BUF_COUNT  1
 
+static uint8_t *g_req_bufs[FPGA_REQ_BUF_COUNT];
+static uint32_t g_req_bufs_free;
+
+
+static void
+_fpga_req_buf_setup(void)
+{
+    g_req_bufs_free = 0;
+
+    for (int i=0; i<FPGA_REQ_BUF_COUNT; i++) {
+        g_req_bufs[i] = heap_caps_malloc(FPGA_REQ_BUF_SIZE, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+        if (g_req_bufs[i])
+            g_req_bufs_free |= (1 << i);
+    }
+}
+
+static void
+_fpga_req_buf_cleanup(void)
+{
+    for (int i=0; i<FPGA_REQ_BUF_COUNT; i++) {
+        free(g_req_bufs[i]);
+        g_req_bufs[i] = NULL;
+    }
+
+    g_req_bufs_free = 0;
+}
+
+static uint8_t *
+_fpga_req_buf_get(size_t len)
+{
+    for (int i=0; i<FPGA_REQ_BUF_COUNT; i++) {
+        if (g_req_bufs_free & (1 << i)) {
+            g_req_bufs_free &= ~(1 << i);
+            return g_req_bufs[i];
+        }
+    }
+
+    return heap_caps_malloc(len, MALLOC_CAP_DMA);
+}
+
+static void
+_fpga_req_buf_put(uint8_t *buf)
+{
+    for (int i=0; i<FPGA_REQ_BUF_COUNT; i++) {
+        if (buf == g_req_bufs[i]) {
+            g_req_bufs_free |= (1 << i);
+            return;
+        }
+    }
+
+    free(buf);
+}
+
+
+static inline uint32_t
+_fpga_req_hash(uint32_t fid)
+{
+    return (fid * 0x9e3779b1) >> (32 - FPGA_REQ_HASH_BITS);
+}
+
+static struct req_entry *
+_fpga_req_find(uint32_t fid)
+{
+    struct req_entry *re;
+
+    for (re=g_req_hash[_fpga_req_hash(fid)]; re; re=re->next)
+        if (re->fid == fid)
+            return re;
+
+    return NULL;
+}
+
+static void
+_fpga_req_insert(struct req_entry *re)
+{
+    uint32_t h = _fpga_req_hash(re->fid);
+
+    re->next = g_req_hash[h];
+    g_req_hash[h] = re;
+}
+
+static void
+_fpga_req_lru_unlink(struct req_entry *re)
+{
+    if (re->lru_prev)
+        re->lru_prev->lru_next = re->lru_next;
+    else
+        g_req_lru_head = re->lru_next;
+
+    if (re->lru_next)
+        re->lru_next->lru_prev = re->lru_prev;
+    else
+        g_req_lru_tail = re->lru_prev;
+
+    re->lru_prev = re->lru_next = NULL;
+}
+
+static void
+_fpga_req_lru_push(struct req_entry *re)
+{
+    re->lru_prev = NULL;
+    re->lru_next = g_req_lru_head;
+
+    if (g_req_lru_head)
+        g_req_lru_head->lru_prev = re;
+    else
+        g_req_lru_tail = re;
+
+    g_req_lru_head = re;
+}
+
+static void
+_fpga_req_file_close(struct req_entry *re)
+{
+    if (!re->fh)
+        return;
+
+    fclose(re->fh);
+    re->fh = NULL;
+
+    _fpga_req_lru_unlink(re);
+    g_req_open_cnt--;
+}
+
+static bool
+_fpga_req_file_open(struct req_entry *re)
+{
+    // Already open, just refresh LRU position
+    if (re->fh) {
+        if (re != g_req_lru_head) {
+            _fpga_req_lru_unlink(re);
+            _fpga_req_lru_push(re);
+        }
+        return true;
+    }
+
+    // Make room
+    while (g_req_open_cnt >= FPGA_REQ_MAX_OPEN)
+        _fpga_req_file_close(g_req_lru_tail);
+
+    // (Re)open
+    re->fh = fopen(re->path, "rb");
+    if (!re->fh)
+        return false;
+
+    re->ofs = 0;
+
+    _fpga_req_lru_push(re);
+    g_req_open_cnt++;
+
+    return true;
+}
+
+/*
+ * Read-ahead cache for file entries
+ *
+ * When a file gets read sequentially, the next blocks are read in the
+ * background by a prefetch task so that the following requests can be
+ * answered from RAM without waiting on the SD card. The cache state is
+ * only touched with g_req_lock held. The prefetch task does its SD card
+ * access without the lock, through its own file handle and into its own
+ * buffer; the slot stays RC_LOADING meanwhile so nobody else reuses it.
+ */
+
+#define FPGA_REQ_CACHE_BLOCK_SIZE   4096
+#define FPGA_REQ_CACHE_BLOCKS       8
+#define FPGA_REQ_CACHE_AHEAD        4
+
+enum req_cache_state {
+    RC_EMPTY = 0,
+    RC_LOADING,
+    RC_VALID,
+};
+
+struct req_cache {
+    size_t   seq_next;      /* Where the next request starts if sequential */
+    uint32_t stamp;         /* LRU counter */
+
+    struct {
+        enum req_cache_state state;
+        uint32_t  blk;
+        uint32_t  stamp;
+        size_t    len;
+        uint8_t  *data;
+    } slot[FPGA_REQ_CACHE_BLOCKS];
+};
+
+struct req_prefetch {
+    uint32_t fid;
+    uint32_t blk;
+    bool     stop;          /* Sent by fpga_req_cleanup() */
+};
+
+static SemaphoreHandle_t g_req_lock;
+static QueueHandle_t     g_req_prefetch_queue;
+static TaskHandle_t      g_req_prefetch_task;
+static SemaphoreHandle_t g_req_prefetch_exited;
+static struct fpga_req_stats g_req_stats;
+
+/* Bitstream load to first FREAD (timing trace) */
+static int64_t g_req_t_armed;
+static volatile int64_t g_req_t_fread1 = -1;
+
+
+static struct req_cache *
+_fpga_req_cache_alloc(void)
+{
+    struct req_cache *rc;
+
+    rc = calloc(1, sizeof(struct req_cache));
+    if (!rc)
+        return NULL;
+
+    for (int i=0; i<FPGA_REQ_CACHE_BLOCKS; i++) {
+        // External RAM is fine, this gets copied to the DMA buffer anyway
+        rc->slot[i].data = heap_caps_malloc(FPGA_REQ_CACHE_BLOCK_SIZE, MALLOC_CAP_SPIRAM);
+        if (!rc->slot[i].data)
+            rc->slot[i].data = malloc(FPGA_REQ_CACHE_BLOCK_SIZE);
+        if (!rc->slot[i].data)
+            goto error;
+    }
+
+    return rc;
+
+error:
+    for (int i=0; i<FPGA_REQ_CACHE_BLOCKS; i++)
+        free(rc->slot[i].data);
+    free(rc);
+    return NULL;
+}
+
+static void
+_fpga_req_cache_free(struct req_cache *rc)
+{
+    if (!rc)
+        return;
+
+    for (int i=0; i<FPGA_REQ_CACHE_BLOCKS; i++)
+        free(rc->slot[i].data);
+    free(rc);
+}
+
+static int
+_fpga_req_cache_find(struct req_cache *rc, uint32_t blk)
+{
+    for (int i=0; i<FPGA_REQ_CACHE_BLOCKS; i++)
+        if ((rc->slot[i].state != RC_EMPTY) && (rc->slot[i].blk == blk))
+            return i;
+    return -1;
+}
+
+static int
+_fpga_req_cache_victim(struct req_cache *rc, uint32_t cur_blk)
+{
+    int v = -1;
+
+    // Empty slot, or least recently used one outside of the read-ahead
+    // window (never throw away what was prefetched for the next reads,
+    // but anything else can go, e.g. when a file is read again from
+    // the start)
+    for (int i=0; i<FPGA_REQ_CACHE_BLOCKS; i++) {
+        if (rc->slot[i].state == RC_EMPTY)
+            return i;
+        if (rc->slot[i].state == RC_LOADING)
+            continue;
+        if ((rc->slot[i].blk - cur_blk) < FPGA_REQ_CACHE_AHEAD)
+            continue;
+        if ((v < 0) || ((int32_t)(rc->slot[i].stamp - rc->slot[v].stamp) < 0))
+            v = i;
+    }
+
+    return v;
+}
+
+static void
+_fpga_req_cache_schedule(struct req_entry *re, size_t ofs)
+{
+    struct req_cache *rc = re->cache;
+    uint32_t cur_blk = ofs / FPGA_REQ_CACHE_BLOCK_SIZE;
+    uint32_t blk = cur_blk;
+
+    for (int i=0; i<FPGA_REQ_CACHE_AHEAD; i++, blk++)
+    {
+        struct req_prefetch pf = { re->fid, blk, false };
+        int s;
+
+        // Past the end or already there ?
+        if (blk >= (re->len + FPGA_REQ_CACHE_BLOCK_SIZE - 1) / FPGA_REQ_CACHE_BLOCK_SIZE)
+            break;
+
+        if (_fpga_req_cache_find(rc, blk) >= 0)
+            continue;
+
+        // Reserve a slot and queue it
+        s = _fpga_req_cache_victim(rc, cur_blk);
+        if (s < 0)
+            break;
+
+        if (xQueueSend(g_req_prefetch_queue, &pf, 0) != pdTRUE)
+            break;
+
+        rc->slot[s].state = RC_LOADING;
+        rc->slot[s].blk   = blk;
+        rc->slot[s].stamp = ++rc->stamp;
+    }
+}
+
+static int
+_fpga_req_prefetch_slot(uint32_t fid, uint32_t blk, struct req_entry **re_p)
+{
+    struct req_entry *re = _fpga_req_find(fid);
+    int s;
+
+    // Slot still waiting for this block ?
+    if (!re || !re->path || !re->cache)
+        return -1;
+
+    s = _fpga_req_cache_find(re->cache, blk);
+    if ((s < 0) || (re->cache->slot[s].state != RC_LOADING))
+        return -1;
+
+    *re_p = re;
+    return s;
+}
+
+static void
+_fpga_req_prefetch_task(void *arg)
+{
+    struct req_prefetch pf;
+    struct req_entry *re;
+    char *path = NULL, *new_path;
+    FILE *fh = NULL;
+    size_t pos = 0;
+    size_t len;
+    uint8_t *buf;
+    int s;
+
+    buf = malloc(FPGA_REQ_CACHE_BLOCK_SIZE);
+
+    while (true) {
+        xQueueReceive(g_req_prefetch_queue, &pf, portMAX_DELAY);
+
+        if (pf.stop)
+            break;
+
+        // Still wanted ? If it's for another file, take a copy of the
+        // path since the entry can go away as soon as we let go
+        new_path = NULL;
+
+        xSemaphoreTake(g_req_lock, portMAX_DELAY);
+
+        s = _fpga_req_prefetch_slot(pf.fid, pf.blk, &re);
+        if ((s >= 0) && (!fh || strcmp(path, re->path))) {
+            new_path = strdup(re->path);
+            if (!new_path) {
+                re->cache->slot[s].state = RC_EMPTY;
+                s = -1;
+            }
+        }
+
+        xSemaphoreGive(g_req_lock);
+
+        if (s < 0)
+            continue;
+
+        // Read the block without holding the lock
+        if (new_path) {
+            if (fh)
+                fclose(fh);
+            free(path);
+            path = new_path;
+            fh = fopen(path, "rb");
+            pos = 0;
+        }
+
+        len = 0;
+
+        if (fh && buf) {
+            size_t ofs = pf.blk * FPGA_REQ_CACHE_BLOCK_SIZE;
+
+            if ((ofs == pos) || !fseek(fh, ofs, SEEK_SET))
+                len = fread(buf, 1, FPGA_REQ_CACHE_BLOCK_SIZE, fh);
+
+            pos = ofs + len;
+        }
+
+        // Hand it over if the slot is still waiting for it
+        xSemaphoreTake(g_req_lock, portMAX_DELAY);
+
+        s = _fpga_req_prefetch_slot(pf.fid, pf.blk, &re);
+        if ((s >= 0) && path && !strcmp(path, re->path)) {
+            struct req_cache *rc = re->cache;
+
+            if (len)
+                memcpy(rc->slot[s].data, buf, len);
+            rc->slot[s].len   = len;
+            rc->slot[s].state = len ? RC_VALID : RC_EMPTY;
+
+            g_req_stats.prefetched++;
+        }
+
+        xSemaphoreGive(g_req_lock);
+    }
+
+    if (fh)
+        fclose(fh);
+    free(path);
+    free(buf);
+
+    xSemaphoreGive(g_req_prefetch_exited);
+    vTaskDelete(NULL);
+}
+
+static size_t
+_fpga_req_file_read(struct req_entry *re, uint8_t *buf, size_t nbyte, size_t ofs)
+{
+    struct req_cache *rc;
+    size_t done = 0;
+    bool seq;
+
+    // Sequential access detection
+    if (!re->cache && (ofs == re->ofs) && (ofs != 0)) {
+        re->cache = _fpga_req_cache_alloc();
+        if (re->cache)
+            re->cache->seq_next = ofs;
+    }
+
+    rc = re->cache;
+    seq = rc && (ofs == rc->seq_next);
+
+    // Serve what we can from cache
+    while (rc && (done < nbyte)) {
+        uint32_t blk  = (ofs + done) / FPGA_REQ_CACHE_BLOCK_SIZE;
+        size_t   bofs = (ofs + done) % FPGA_REQ_CACHE_BLOCK_SIZE;
+        size_t   l;
+        int      s;
+
+        s = _fpga_req_cache_find(rc, blk);
+        if ((s < 0) || (rc->slot[s].state != RC_VALID) || (bofs >= rc->slot[s].len))
+            break;
+
+        l = rc->slot[s].len - bofs;
+        if (l > (nbyte - done))
+            l = nbyte - done;
+
+        memcpy(&buf[done], &rc->slot[s].data[bofs], l);
+        rc->slot[s].stamp = ++rc->stamp;
+        done += l;
+    }
+
+    // Read the rest directly
+    if (done < nbyte) {
+        g_req_stats.misses++;
+
+        if ((ofs + done) != re->ofs)
+            fseek(re->fh, ofs + done, SEEK_SET);
+
+        done += fread(&buf[done], 1, nbyte - done, re->fh);
+        re->ofs = ofs + done;
+    } else {
+        g_req_stats.hits++;
+    }
+
+    // Keep the next blocks coming
+    if (rc) {
+        rc->seq_next = ofs + nbyte;
+        if (seq)
+            _fpga_req_cache_schedule(re, ofs + nbyte);
+    }
+
+    return done;
+}
+
+static void
+_fpga_req_release_entry(struct req_entry *re)
+{
+    if (re->mapped) {
+        if (re->map_appfs)
+            appfsMunmap(re->map);
+        else
+            spi_flash_munmap(re->map);
+    }
+
+    _fpga_req_file_close(re);
+    _fpga_req_cache_free(re->cache);
+    free(re->path);
+    free(re);
+}
 
 static void
 _fpga_req_delete_entry(uint32_t fid)
@@ -422,56 +1890,65 @@ _fpga_req_delete_entry(uint32_t fid)
     struct req_entry **re_ptr;
     struct req_entry *re;
 
-    // Scan entries for a matching one
-    re_ptr = &g_req_entries;
+    xSemaphoreTake(g_req_lock, portMAX_DELAY);
+
+    // Scan bucket for matching entries
+    re_ptr = &g_req_hash[_fpga_req_hash(fid)];
     re = *re_ptr;
 
     while (re) {
         // Match ?
         if (re->fid == fid) {
-            // Remove from list
+            // Remove from list and release
             *re_ptr = re->next;
-
-            // Release
-            if (re->fh)
-                fclose(re->fh);
-            free(re);
+            _fpga_req_release_entry(re);
+        } else {
+            // Next
+            re_ptr = &re->next;
         }
 
-        // Next
-        re_ptr = &re->next;
         re = *re_ptr;
     }
+
+    xSemaphoreGive(g_req_lock);
 }
 
 static struct req_entry *
 _fpga_req_open_file(uint32_t fid, const char *path)
 {
     struct req_entry *re;
-    FILE *fh;
 
-    // Open file
-    fh = fopen(path, "rb");
-    if (!fh)
+    // Alloc new entry
+    re = calloc(1, sizeof(struct req_entry));
+    if (!re)
+        return NULL;
+
+    re->fid  = fid;
+    re->path = strdup(path);
+    if (!re->path) {
+        free(re);
         return NULL;
+    }
+
+    xSemaphoreTake(g_req_lock, portMAX_DELAY);
 
-    // Alloc new entry
-    re = calloc(1, sizeof(struct req_entry));
-    if (!re)
+    // Open file
+    if (!_fpga_req_file_open(re)) {
+        xSemaphoreGive(g_req_lock);
+        free(re->path);
+        free(re);
         return NULL;
+    }
 
-    // Add it to list
-    re->next = g_req_entries;
-    g_req_entries = re;
+    // Get length
+    fseek(re->fh, 0, SEEK_END);
+    re->len = ftell(re->fh);
+    fseek(re->fh, 0, SEEK_SET);
 
-    // Init fields
-    re->fid = fid;
-    re->fh  = fh;
-    re->ofs = 0;
+    // Add it to table
+    _fpga_req_insert(re);
 
-    fseek(fh, 0, SEEK_END);
-    re->len = ftell(fh);
-    fseek(fh, 0, SEEK_SET);
+    xSemaphoreGive(g_req_lock);
 
     // Done
     return re;
@@ -483,14 +1960,40 @@ _fpga_req_get_file(uint32_t fid)
     struct req_entry *re;
     char path[32];
 
-    // Scan entries for a matching one
-    for (re=g_req_entries; re; re=re->next)
-        if (re->fid == fid)
-            return re;
+    // Look for a matching entry
+    re = _fpga_req_find(fid);
+    if (re)
+        return re;
 
     // Nothing found, try to open file
     snprintf(path, sizeof(path), "/sd/fpga_%08x.dat", fid);
-    return _fpga_req_open_file(fid, path);
+    re = _fpga_req_open_file(fid, path);
+    if (re)
+        return re;
+
+    // Forget the oldest empty entry if we have too many. It might have
+    // been replaced by an actual binding since, leave those alone.
+    if (g_req_empty_cnt == FPGA_REQ_MAX_EMPTY) {
+        struct req_entry *old = _fpga_req_find(g_req_empty[0]);
+
+        if (old && !old->path && !old->data && !old->mapped)
+            _fpga_req_delete_entry(g_req_empty[0]);
+
+        memmove(&g_req_empty[0], &g_req_empty[1], sizeof(uint32_t) * (FPGA_REQ_MAX_EMPTY - 1));
+        g_req_empty_cnt--;
+    }
+
+    // Remember there is nothing there (empty entry)
+    re = calloc(1, sizeof(struct req_entry));
+    if (re) {
+        g_req_empty[g_req_empty_cnt++] = fid;
+        re->fid = fid;
+        xSemaphoreTake(g_req_lock, portMAX_DELAY);
+        _fpga_req_insert(re);
+        xSemaphoreGive(g_req_lock);
+    }
+
+    return re;
 }
 
 static ssize_t
@@ -512,22 +2015,22 @@ _fpga_req_fread(uint32_t fid, void *buf, size_t nbyte, size_t ofs)
     }
 
     // Deal with requests too large
-    if ((ofs + nbyte) > re->len) {
+    if (nbyte > re->len - ofs) {
         size_t l = re->len - ofs;
         memset(buf+l, 0x00, nbyte-l);
         nbyte = l;
     }
 
     // Is it a file
-    if (re->fh) {
-        // Seek ?
-        if (ofs != re->ofs)
-            fseek(re->fh, ofs, SEEK_SET);
-
-        re->ofs = ofs + nbyte;
-
-        // Read data
-        nbyte = fread(buf, 1, nbyte, re->fh);
+    if (re->path) {
+        xSemaphoreTake(g_req_lock, portMAX_DELAY);
+        if (_fpga_req_file_open(re)) {
+            nbyte = _fpga_req_file_read(re, buf, nbyte, ofs);
+        } else {
+            memset(buf, 0x00, nbyte);
+            nbyte = 0;
+        }
+        xSemaphoreGive(g_req_lock);
     }
 
     // Or a raw data block
@@ -539,29 +2042,91 @@ _fpga_req_fread(uint32_t fid, void *buf, size_t nbyte, size_t ofs)
 }
 
 
+static esp_err_t _fpga_req_serve_fread(ICE40 *ice40, void *arg);
+static esp_err_t _fpga_req_serve_fwrite(ICE40 *ice40, void *arg);
+static void _fpga_req_wr_setup(void);
+static void _fpga_req_wr_cleanup(void);
+
 void
 fpga_req_setup(void)
 {
-    g_req_entries = NULL;
+    memset(g_req_hash, 0x00, sizeof(g_req_hash));
+    g_req_lru_head = g_req_lru_tail = NULL;
+    g_req_open_cnt = 0;
+    g_req_empty_cnt = 0;
+    memset(&g_req_stats, 0x00, sizeof(g_req_stats));
+
+    _fpga_req_buf_setup();
+
+    g_req_lock = xSemaphoreCreateMutex();
+    g_req_prefetch_queue = xQueueCreate(2 * FPGA_REQ_CACHE_AHEAD, sizeof(struct req_prefetch));
+    g_req_prefetch_exited = xSemaphoreCreateBinary();
+    xTaskCreate(_fpga_req_prefetch_task, "fpga_prefetch", 3072, NULL, tskIDLE_PRIORITY + 1, &g_req_prefetch_task);
+
+    _fpga_req_wr_setup();
+
+    fpga_irq_register(SPI_REQ_SRC_FREAD, _fpga_req_serve_fread, NULL);
+    fpga_irq_register(SPI_REQ_SRC_FWRITE, _fpga_req_serve_fwrite, NULL);
 }
 
 void
 fpga_req_cleanup(void)
 {
+    struct req_prefetch pf = { .stop = true };
     struct req_entry *re_cur, *re_nxt;
 
-    re_cur = g_req_entries;
+    fpga_irq_unregister(SPI_REQ_SRC_FREAD);
+    fpga_irq_unregister(SPI_REQ_SRC_FWRITE);
+
+    // Flush and stop write-behind
+    _fpga_req_wr_cleanup();
+
+    // Stop prefetch. It may be in the middle of a read, let it finish
+    // and close its file instead of deleting it from under FATFS.
+    xQueueSendToFront(g_req_prefetch_queue, &pf, portMAX_DELAY);
+    xSemaphoreTake(g_req_prefetch_exited, portMAX_DELAY);
+
+    vQueueDelete(g_req_prefetch_queue);
+    vSemaphoreDelete(g_req_prefetch_exited);
+
+    xSemaphoreTake(g_req_lock, portMAX_DELAY);
 
-    while (re_cur)
+    for (int h=0; h<FPGA_REQ_HASH_SIZE; h++)
     {
-        re_nxt = re_cur->next;
-        if (re_cur->fh)
-            fclose(re_cur->fh);
-        free(re_cur);
-        re_cur = re_nxt;
+        re_cur = g_req_hash[h];
+
+        while (re_cur)
+        {
+            re_nxt = re_cur->next;
+            _fpga_req_release_entry(re_cur);
+            re_cur = re_nxt;
+        }
+
+        g_req_hash[h] = NULL;
     }
 
-    g_req_entries = NULL;
+    vSemaphoreDelete(g_req_lock);
+
+    _fpga_req_buf_cleanup();
+}
+
+void
+fpga_req_get_stats(struct fpga_req_stats *stats)
+{
+    *stats = g_req_stats;
+}
+
+void
+fpga_req_trace_arm(void)
+{
+    g_req_t_fread1 = -1;
+    g_req_t_armed  = esp_timer_get_time();
+}
+
+int64_t
+fpga_req_trace_first_fread(void)
+{
+    return g_req_t_fread1;
 }
 
 int
@@ -580,113 +2145,528 @@ fpga_req_add_file_alias(uint32_t fid, const char *path)
     return 0;
 }
 
-int
-fpga_req_add_file_data(uint32_t fid, void *data, size_t len)
+void *
+fpga_req_alloc_file_data(uint32_t fid, size_t len)
 {
     struct req_entry *re;
     void *buf;
 
+    // Length comes from the host, don't let the size below wrap
+    if (len > FPGA_REQ_MAX_DATA)
+        return NULL;
+
     // Remove any previous entries
     _fpga_req_delete_entry(fid);
 
-    // Alloc new entry
-    buf = malloc(sizeof(struct req_entry) + len);
+    // Alloc new entry (with a spare byte in front of the data for the
+    // FREAD_PUT command, see _fpga_req_serve_fread)
+    buf = malloc(sizeof(struct req_entry) + 1 + len);
     if (!buf)
-        return -ENOMEM;
+        return NULL;
 
     re = buf;
     memset(re, 0x00, sizeof(struct req_entry));
 
-    // Add it to list
-    re->next = g_req_entries;
-    g_req_entries = re;
-
     // Init fields
     re->fid  = fid;
-    re->data = buf + sizeof(struct req_entry);
+    re->data = buf + sizeof(struct req_entry) + 1;
     re->len  = len;
 
+    // Add it to table
+    xSemaphoreTake(g_req_lock, portMAX_DELAY);
+    _fpga_req_insert(re);
+    xSemaphoreGive(g_req_lock);
+
+    // Done, caller fills the data
+    return re->data;
+}
+
+int
+fpga_req_add_file_data(uint32_t fid, void *data, size_t len)
+{
+    void *buf;
+
+    // Alloc entry
+    buf = fpga_req_alloc_file_data(fid, len);
+    if (!buf)
+        return -ENOMEM;
+
     // Copy actual data
-    memcpy(re->data, data, len);
+    memcpy(buf, data, len);
 
     // Done
     return 0;
 }
 
+/*
+ * Bindings to data in flash (AppFS file or raw partition region), served
+ * from a memory mapping. The SPI DMA can't read from flash so requests
+ * still go through a pool buffer, but there is no SD card / FATFS access
+ * and nothing kept in RAM.
+ */
+
+static int
+_fpga_req_add_mapped(uint32_t fid, const void *ptr, size_t len,
+                     spi_flash_mmap_handle_t map, bool appfs)
+{
+    struct req_entry *re;
+
+    // Alloc new entry
+    re = calloc(1, sizeof(struct req_entry));
+    if (!re) {
+        if (appfs)
+            appfsMunmap(map);
+        else
+            spi_flash_munmap(map);
+        return -ENOMEM;
+    }
+
+    // Init fields
+    re->fid       = fid;
+    re->data      = (void*)ptr;
+    re->len       = len;
+    re->mapped    = true;
+    re->map_appfs = appfs;
+    re->map       = map;
+
+    // Add it to table
+    xSemaphoreTake(g_req_lock, portMAX_DELAY);
+    _fpga_req_insert(re);
+    xSemaphoreGive(g_req_lock);
+
+    return 0;
+}
+
+int
+fpga_req_add_file_appfs(uint32_t fid, const char *name)
+{
+    spi_flash_mmap_handle_t map;
+    appfs_handle_t fd;
+    const void *ptr;
+    int size;
+
+    // Remove any previous entries
+    _fpga_req_delete_entry(fid);
+
+    // Find and map file
+    fd = appfsOpen(name);
+    if (fd == APPFS_INVALID_FD)
+        return -ENOENT;
+
+    appfsEntryInfo(fd, NULL, &size);
+
+    if (appfsMmap(fd, 0, size, &ptr, SPI_FLASH_MMAP_DATA, &map) != ESP_OK)
+        return -EIO;
+
+    return _fpga_req_add_mapped(fid, ptr, size, map, true);
+}
+
+int
+fpga_req_add_file_partition(uint32_t fid, const char *label, size_t ofs, size_t len)
+{
+    const esp_partition_t *part;
+    spi_flash_mmap_handle_t map;
+    const void *ptr;
+
+    // Remove any previous entries
+    _fpga_req_delete_entry(fid);
+
+    // Find partition and validate region (len 0 means up to the end)
+    part = esp_partition_find_first(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (!part)
+        return -ENOENT;
+
+    if (ofs > part->size)
+        return -EINVAL;
+
+    if (!len)
+        len = part->size - ofs;
+
+    if (len > (part->size - ofs))
+        return -EINVAL;
+
+    // Map it
+    if (esp_partition_mmap(part, ofs, len, SPI_FLASH_MMAP_DATA, &ptr, &map) != ESP_OK)
+        return -EIO;
+
+    return _fpga_req_add_mapped(fid, ptr, len, map, false);
+}
+
 void
 fpga_req_del_file(uint32_t fid)
 {
     _fpga_req_delete_entry(fid);
 }
 
-bool
-fpga_req_process(ICE40 *ice40, TickType_t wait, esp_err_t *err)
+static esp_err_t
+_fpga_req_serve_fread(ICE40 *ice40, void *arg)
 {
     esp_err_t res;
     uint8_t buf[12];
-    uint8_t req;
+    struct req_entry *re;
+    uint32_t req_file_id;
+    uint32_t req_offset;
+    uint32_t req_length;
+    uint8_t *buf_req;
 
-    // Default is no error
-    *err = ESP_OK;
+    fpga_link_lock();
 
-    // If the FPGA isn't requesting anything ... we have nothing to do !
-    if (!fpga_irq_wait(wait))
-        return false;
+    // Get file request: Command
+    buf[0] = SPI_CMD_FREAD_GET;
+    res = _fpga_link_send(ice40, buf, 1);
+
+    // Get file request: Response
+    if (res == ESP_OK) {
+        buf[0] = SPI_CMD_RESP_ACK;
+        res = ice40_transaction(ice40, buf, 12, buf, 12);
+    }
+
+    fpga_link_unlock();
 
-    // Poll status byte to see what's up
-    buf[0] = SPI_CMD_NOP2;
-    res = ice40_transaction(ice40, buf, 2, buf, 2);
     if (res != ESP_OK)
-        goto error;
+        return res;
 
-    req = buf[1] & 0xf;
+    req_file_id = (buf[2] << 24) | (buf[3] << 16) | (buf[4] << 8) | buf[5];
+    req_offset  = (buf[6] << 24) | (buf[7] << 16) | (buf[8] << 8) | buf[9];
+    req_length  = ((buf[10] << 8) | buf[11]) + 1;
 
-    // File requests
-    if (req & SPI_REQ_FREAD) {
-        uint32_t req_file_id;
-        uint32_t req_offset;
-        uint16_t req_length;
-        uint8_t *buf_req;
+    if ((g_req_t_fread1 < 0) && g_req_t_armed)
+        g_req_t_fread1 = esp_timer_get_time() - g_req_t_armed;
 
-        // Get file request: Command
-        buf[0] = SPI_CMD_FREAD_GET;
-        res = ice40_send(ice40, buf, 1);
-        if (res != ESP_OK)
-            goto error;
+    // Raw data entries are sent straight from the entry when the
+    // SPI DMA can use them as-is. The byte in front of the data is
+    // temporarily replaced by the command.
+    re = _fpga_req_get_file(req_file_id);
+    buf_req = NULL;
 
-        // Get file request: Response
-        buf[0] = SPI_CMD_RESP_ACK;
-        res = ice40_transaction(ice40, buf, 12, buf, 12);
-        if (res != ESP_OK)
-            goto error;
+    if (re && re->data && !re->mapped && (req_offset < re->len) && (req_length <= re->len - req_offset))
+        buf_req = (uint8_t*)re->data + req_offset - 1;
+
+    if (buf_req && esp_ptr_dma_capable(buf_req) && !((uintptr_t)buf_req & 3))
+    {
+        uint8_t save = buf_req[0];
 
-        req_file_id = (buf[2] << 24) | (buf[3] << 16) | (buf[4] << 8) | buf[5];
-        req_offset  = (buf[6] << 24) | (buf[7] << 16) | (buf[8] << 8) | buf[9];
-        req_length  = ((buf[10] << 8) | buf[11]) + 1;
+        buf_req[0] = SPI_CMD_FREAD_PUT;
+        fpga_link_lock();
+        res = _fpga_link_send(ice40, buf_req, req_length+1);
+        fpga_link_unlock();
+        buf_req[0] = save;
+
+        if (res != ESP_OK)
+            return res;
+    }
 
-        // Get buffer
-        buf_req = malloc(req_length + 1);
+    // Otherwise go through a pool buffer
+    else
+    {
+        buf_req = _fpga_req_buf_get(req_length + 1);
+        if (!buf_req)
+            return ESP_ERR_NO_MEM;
 
         // Load data from file
         _fpga_req_fread(req_file_id, &buf_req[1], req_length, req_offset);
 
         // Send data
         buf_req[0] = SPI_CMD_FREAD_PUT;
-        res = ice40_send(ice40, buf_req, req_length+1);
-        if (res != ESP_OK) {
-            free(buf_req);
-            goto error;
+        fpga_link_lock();
+        res = _fpga_link_send(ice40, buf_req, req_length+1);
+        fpga_link_unlock();
+        _fpga_req_buf_put(buf_req);
+
+        if (res != ESP_OK)
+            return res;
+    }
+
+    return ESP_OK;
+}
+
+
+/*
+ * File writes: data from the FPGA is copied into a large ring buffer and
+ * written to the SD card by a background task, in cluster aligned chunks,
+ * so servicing the request never waits on FAT latency. If the ring is
+ * full, the data is dropped (and counted).
+ *
+ * Writes go to the same file a read of that fid would use. They're not
+ * coherent with FREAD on the same fid (read-ahead cache, open handles).
+ */
+
+#define FPGA_REQ_WR_RING_SIZE   (256 * 1024)    /* In PSRAM */
+#define FPGA_REQ_WR_RING_SMALL  ( 32 * 1024)    /* Internal RAM fallback */
+#define FPGA_REQ_WR_CLUSTER     32768
+#define FPGA_REQ_WR_IDLE_MS     500
+
+struct req_wr_hdr {
+    uint32_t fid;
+    uint32_t ofs;
+    uint32_t len;
+    char     path[64];
+};
+
+static struct {
+    RingbufHandle_t    ring;
+    StaticRingbuffer_t ring_ctrl;
+    uint8_t           *ring_mem;
+    uint8_t           *stage;       /* Current cluster */
+    TaskHandle_t       task;
+    SemaphoreHandle_t  done;        /* Given by the task when it exits */
+    size_t             max_data;    /* Largest payload one ring item can hold */
+    volatile bool      stop;
+} g_req_wr;
+
+
+static void
+_fpga_req_wr_flush(FILE *fh, const uint8_t *stage, size_t *stage_len, uint32_t *stage_ofs)
+{
+    size_t l;
+
+    if (!*stage_len)
+        return;
+
+    l = 0;
+    if (fh && !fseek(fh, *stage_ofs, SEEK_SET))
+        l = fwrite(stage, 1, *stage_len, fh);
+
+    g_req_stats.wr_bytes   += l;
+    g_req_stats.wr_dropped += *stage_len - l;
+
+    *stage_ofs += *stage_len;
+    *stage_len  = 0;
+}
+
+static void
+_fpga_req_wr_task(void *arg)
+{
+    FILE *fh = NULL;
+    char path[64] = "";
+    uint8_t *stage = g_req_wr.stage;
+    size_t stage_len = 0;
+    uint32_t stage_ofs = 0;
+
+    while (true)
+    {
+        struct req_wr_hdr *hdr;
+        const uint8_t *data;
+        size_t size, len;
+        bool stop = g_req_wr.stop;
+
+        // Next block. When idle, push out the partial cluster. Once asked
+        // to stop, keep going until the ring is empty.
+        hdr = xRingbufferReceive(g_req_wr.ring, &size, stop ? 0 : pdMS_TO_TICKS(FPGA_REQ_WR_IDLE_MS));
+        if (!hdr) {
+            if (stop)
+                break;
+            _fpga_req_wr_flush(fh, stage, &stage_len, &stage_ofs);
+            if (fh)
+                fflush(fh);
+            continue;
+        }
+
+        data = (const uint8_t *)(hdr + 1);
+        len  = hdr->len;
+
+        // Not contiguous with what we have staged or other file
+        if (strcmp(hdr->path, path) || (hdr->ofs != (stage_ofs + stage_len)))
+        {
+            _fpga_req_wr_flush(fh, stage, &stage_len, &stage_ofs);
+
+            if (strcmp(hdr->path, path)) {
+                if (fh)
+                    fclose(fh);
+
+                strcpy(path, hdr->path);
+
+                fh = fopen(path, "r+b");
+                if (!fh)
+                    fh = fopen(path, "w+b");
+                if (fh)
+                    setvbuf(fh, NULL, _IONBF, 0);
+            }
+
+            stage_ofs = hdr->ofs;
+        }
+
+        // Stage it, writing out each time we reach a cluster boundary
+        while (len)
+        {
+            size_t l = FPGA_REQ_WR_CLUSTER - ((stage_ofs + stage_len) % FPGA_REQ_WR_CLUSTER);
+
+            if (l > len)
+                l = len;
+
+            memcpy(&stage[stage_len], data, l);
+            stage_len += l;
+            data += l;
+            len  -= l;
+
+            if (!((stage_ofs + stage_len) % FPGA_REQ_WR_CLUSTER))
+                _fpga_req_wr_flush(fh, stage, &stage_len, &stage_ofs);
         }
 
-        // Done with buffer
-        free(buf_req);
+        vRingbufferReturnItem(g_req_wr.ring, hdr);
     }
 
-    // Done !
-    return true;
+    // Finish up with the staged partial cluster
+    _fpga_req_wr_flush(fh, stage, &stage_len, &stage_ofs);
+    if (fh)
+        fclose(fh);
 
-error:
-    if (err)
-        *err = res;
-    return false;
+    xSemaphoreGive(g_req_wr.done);
+    vTaskDelete(NULL);
+}
+
+static void
+_fpga_req_wr_setup(void)
+{
+    size_t size = FPGA_REQ_WR_RING_SIZE;
+
+    memset(&g_req_wr, 0x00, sizeof(g_req_wr));
+
+    g_req_wr.stage = malloc(FPGA_REQ_WR_CLUSTER);
+    if (!g_req_wr.stage)
+        return;
+
+    g_req_wr.ring_mem = heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+    if (!g_req_wr.ring_mem) {
+        size = FPGA_REQ_WR_RING_SMALL;
+        g_req_wr.ring_mem = heap_caps_malloc(size, MALLOC_CAP_8BIT);
+    }
+    if (!g_req_wr.ring_mem)
+        return;
+
+    g_req_wr.ring = xRingbufferCreateStatic(size, RINGBUF_TYPE_NOSPLIT, g_req_wr.ring_mem, &g_req_wr.ring_ctrl);
+
+    // Requests larger than that (the small ring can't take 64k) are split
+    g_req_wr.max_data = (xRingbufferGetMaxItemSize(g_req_wr.ring) - sizeof(struct req_wr_hdr)) & ~3;
+
+    // Own semaphore to wait for exit, the caller's task notification is
+    // already used by fpga_wb_wait()
+    g_req_wr.done = xSemaphoreCreateBinary();
+    if (!g_req_wr.done)
+        return;
+
+    if (xTaskCreate(_fpga_req_wr_task, "fpga_wr", 3072, NULL, tskIDLE_PRIORITY + 1, &g_req_wr.task) != pdPASS)
+        g_req_wr.task = NULL;
+}
+
+static void
+_fpga_req_wr_cleanup(void)
+{
+    if (g_req_wr.task) {
+        g_req_wr.stop = true;
+        xSemaphoreTake(g_req_wr.done, portMAX_DELAY);
+    }
+
+    if (g_req_wr.done)
+        vSemaphoreDelete(g_req_wr.done);
+
+    if (g_req_wr.ring)
+        vRingbufferDelete(g_req_wr.ring);
+
+    free(g_req_wr.ring_mem);
+    free(g_req_wr.stage);
+
+    memset(&g_req_wr, 0x00, sizeof(g_req_wr));
+}
+
+static esp_err_t
+_fpga_req_serve_fwrite(ICE40 *ice40, void *arg)
+{
+    esp_err_t res;
+    struct req_entry *re;
+    struct req_wr_hdr *hdr;
+    uint32_t req_file_id;
+    uint32_t req_offset;
+    uint32_t req_length;
+    uint8_t *buf, *data;
+
+    buf = _fpga_req_buf_get(FPGA_REQ_BUF_SIZE);
+    if (!buf)
+        return ESP_ERR_NO_MEM;
+
+    fpga_link_lock();
+
+    // Get write request: Command & Response
+    buf[0] = SPI_CMD_FWRITE_GET;
+    res = _fpga_link_send(ice40, buf, 1);
+
+    if (res == ESP_OK) {
+        buf[0] = SPI_CMD_RESP_ACK;
+        res = ice40_transaction(ice40, buf, 12, buf, 12);
+    }
+
+    req_file_id = (buf[2] << 24) | (buf[3] << 16) | (buf[4] << 8) | buf[5];
+    req_offset  = (buf[6] << 24) | (buf[7] << 16) | (buf[8] << 8) | buf[9];
+    req_length  = ((buf[10] << 8) | buf[11]) + 1;
+
+    // Get the data itself
+    if (res == ESP_OK) {
+        buf[0] = SPI_CMD_FWRITE_DAT;
+        res = _fpga_link_send(ice40, buf, 1);
+    }
+
+    if (res == ESP_OK) {
+        buf[0] = SPI_CMD_RESP_ACK;
+        res = ice40_transaction(ice40, buf, req_length + 2, buf, req_length + 2);
+    }
+
+    fpga_link_unlock();
+
+    if (res != ESP_OK)
+        goto done;
+
+    // Find target. Only files, and forget any 'nothing there' entry
+    // since we're about to create it
+    re = _fpga_req_find(req_file_id);
+
+    if (re && !re->path && (re->data || re->mapped))
+        goto drop;
+
+    if (re && re->path && (strlen(re->path) >= sizeof(hdr->path)))
+        goto drop;
+
+    if (re && !re->path) {
+        _fpga_req_delete_entry(req_file_id);
+        re = NULL;
+    }
+
+    // Queue it for the writer, in as many items as the ring needs
+    if (!g_req_wr.ring || !g_req_wr.max_data)
+        goto drop;
+
+    data = &buf[2];
+
+    while (req_length)
+    {
+        size_t l = (req_length > g_req_wr.max_data) ? g_req_wr.max_data : req_length;
+
+        if (xRingbufferSendAcquire(g_req_wr.ring, (void**)&hdr, sizeof(struct req_wr_hdr) + l, 0) != pdTRUE)
+            goto drop;
+
+        hdr->fid = req_file_id;
+        hdr->ofs = req_offset;
+        hdr->len = l;
+
+        if (re)
+            snprintf(hdr->path, sizeof(hdr->path), "%s", re->path);
+        else
+            snprintf(hdr->path, sizeof(hdr->path), "/sd/fpga_%08x.dat", req_file_id);
+
+        memcpy(hdr + 1, data, l);
+
+        xRingbufferSendComplete(g_req_wr.ring, hdr);
+
+        data       += l;
+        req_offset += l;
+        req_length -= l;
+    }
+
+    goto done;
+
+drop:
+    g_req_stats.wr_dropped += req_length;
+
+done:
+    _fpga_req_buf_put(buf);
+    return res;
 }
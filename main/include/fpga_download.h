@@ -6,3 +6,4 @@
 #include <freertos/FreeRTOS.h>
 
 void fpga_download(xQueueHandle buttonQueue, ICE40* ice40, pax_buf_t* pax_buffer, ILI9341* ili9341);
+void fpga_launch(xQueueHandle buttonQueue, ICE40* ice40, pax_buf_t* pax_buffer, ILI9341* ili9341, const char* name);
@@ -12,3 +12,4 @@
 
 void fpga_test(xQueueHandle buttonQueue, pax_buf_t* pax_buffer, ILI9341* ili9341);
 bool run_fpga_tests(xQueueHandle buttonQueue, pax_buf_t* pax_buffer, ILI9341* ili9341);
+void fpga_spi_bench(xQueueHandle buttonQueue, pax_buf_t* pax_buffer, ILI9341* ili9341);
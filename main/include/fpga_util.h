@@ -12,8 +12,11 @@
 #include <esp_err.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <freertos/semphr.h>
 
 #include "ice40.h"
+#include "pax_gfx.h"
+#include "rp2040.h"
 
 
 /* SPI protocol  ---------------------------------------------------------- */
@@ -26,12 +29,43 @@
 #define SPI_CMD_BUTTON_REPORT       0xf4
 #define SPI_CMD_FREAD_GET           0xf8
 #define SPI_CMD_FREAD_PUT           0xf9
+#define SPI_CMD_FWRITE_GET          0xfa
+#define SPI_CMD_FWRITE_DAT          0xfb
 #define SPI_CMD_IRQ_ACK             0xfd
 #define SPI_CMD_RESP_ACK            0xfe
 #define SPI_CMD_NOP2                0xff
 
 /* Request bits */
-#define SPI_REQ_FREAD               (1 << 0)
+#define SPI_REQ_SRC_FREAD           0
+#define SPI_REQ_SRC_FWRITE          1
+#define SPI_REQ_FREAD               (1 << SPI_REQ_SRC_FREAD)
+#define SPI_REQ_FWRITE              (1 << SPI_REQ_SRC_FWRITE)
+#define SPI_REQ_MASK                0x0f
+
+
+/* Bitstream loading ------------------------------------------------------ */
+
+esp_err_t fpga_bitstream_begin(ICE40 *ice40);
+esp_err_t fpga_bitstream_write(ICE40 *ice40, const uint8_t *data, size_t len);
+esp_err_t fpga_bitstream_end(ICE40 *ice40);
+void      fpga_bitstream_abort(ICE40 *ice40);
+
+
+/* Bitstream library ------------------------------------------------------ */
+
+#define FPGA_LIB_SUFFIX     ".bit"  /* AppFS names of stored bitstreams */
+
+bool      fpga_lib_is_bitstream(const char *name);
+esp_err_t fpga_lib_load(ICE40 *ice40, const char *name);
+
+
+/* Link arbitration ------------------------------------------------------- */
+
+void fpga_link_lock(void);
+void fpga_link_unlock(void);
+
+void fpga_link_set_turbo(bool turbo);
+bool fpga_link_get_turbo(void);
 
 
 /* FPGA IRQ --------------------------------------------------------------- */
@@ -39,11 +73,56 @@
 esp_err_t fpga_irq_setup(ICE40 *ice40);
 void      fpga_irq_cleanup(ICE40 *ice40);
 bool      fpga_irq_wait(TickType_t wait);
+bool      fpga_irq_add_to_set(QueueSetHandle_t set);
+void      fpga_irq_remove_from_set(QueueSetHandle_t set);
+bool      fpga_irq_is_member(QueueSetMemberHandle_t member);
+
+#define FPGA_IRQ_SOURCES    4   /* One per bit of SPI_REQ_MASK */
+
+typedef esp_err_t (*fpga_irq_handler_fn)(ICE40 *ice40, void *arg);
+
+struct fpga_irq_stats {
+    uint32_t irqs;                      /* IRQ wake ups */
+    uint32_t polls;                     /* Status byte reads */
+    uint32_t served[FPGA_IRQ_SOURCES];  /* Handler calls per request bit */
+    uint32_t unhandled;                 /* Status with only unknown request bits */
+    uint64_t lat_sum;                   /* IRQ edge to dispatch latency (us) */
+    uint32_t lat_max;
+};
+
+esp_err_t fpga_irq_register(int src, fpga_irq_handler_fn fn, void *arg);
+void      fpga_irq_unregister(int src);
+void      fpga_irq_get_stats(struct fpga_irq_stats *stats);
+bool      fpga_irq_dispatch(ICE40 *ice40, TickType_t wait, esp_err_t *err);
 
 
 /* Wishbone bridge -------------------------------------------------------- */
 
-struct fpga_wb_cmdbuf;
+#define FPGA_WB_MAX_READS   64
+
+struct fpga_wb_cmdbuf {
+    bool       done;
+    uint8_t   *buf;
+    int        len;
+    int        used;
+    int        rd_cnt;
+    int        rd_max;
+    uint32_t **rd_ptr;
+};
+
+/* Command buffer for up to n single read/write on the stack, no allocation.
+ * Use fpga_wb_reset() to reuse it after fpga_wb_exec() */
+#define FPGA_WB_CMDBUF_LEN(n)   (1 + ((n) * 8))
+#define FPGA_WB_CMDBUF_LOCAL(name, n) \
+    uint8_t   name ## _buf[FPGA_WB_CMDBUF_LEN(n)] __attribute__((aligned(4))); \
+    uint32_t *name ## _rd[((n) < FPGA_WB_MAX_READS) ? (n) : FPGA_WB_MAX_READS]; \
+    struct fpga_wb_cmdbuf name ## _cb; \
+    struct fpga_wb_cmdbuf *name = fpga_wb_init(&name ## _cb, \
+        name ## _buf, sizeof(name ## _buf), \
+        name ## _rd, sizeof(name ## _rd) / sizeof(uint32_t*))
+
+struct fpga_wb_cmdbuf *fpga_wb_init(struct fpga_wb_cmdbuf *cb, uint8_t *buf, int len, uint32_t **rd_ptr, int rd_max);
+void fpga_wb_reset(struct fpga_wb_cmdbuf *cb);
 
 struct fpga_wb_cmdbuf *fpga_wb_alloc(int n);
 void fpga_wb_free(struct fpga_wb_cmdbuf *cb);
@@ -55,19 +134,80 @@ bool fpga_wb_queue_read_burst(struct fpga_wb_cmdbuf *cb, int dev, uint32_t addr,
 
 bool fpga_wb_exec(struct fpga_wb_cmdbuf *cb, ICE40* ice40);
 
+bool fpga_wb_write_bulk(ICE40 *ice40, int dev, uint32_t addr, const uint32_t *val, int n, bool inc);
+bool fpga_wb_read_bulk(ICE40 *ice40, int dev, uint32_t addr, uint32_t *val, int n, bool inc);
+
+/* Called from the async service task, without the link held. It may use the
+ * link or submit more work (fpga_wb_submit() doesn't wait for queue space
+ * there), but shouldn't block for long: other completions wait behind it */
+typedef void (*fpga_wb_done_fn)(struct fpga_wb_cmdbuf *cb, bool ok, void *arg);
+
+esp_err_t fpga_wb_async_start(ICE40 *ice40);
+void      fpga_wb_async_stop(void);
+bool      fpga_wb_submit(struct fpga_wb_cmdbuf *cb, fpga_wb_done_fn done, void *arg);
+bool      fpga_wb_wait(TickType_t wait);
+
+/* Times n words packed + unpacked 'rounds' times, bswap vs byte by byte (us).
+ * Returns false if either failed to round trip or on allocation failure */
+bool fpga_wb_pack_bench(int n, int rounds, int64_t *t_bswap, int64_t *t_bytes);
+
 
 /* Button reports --------------------------------------------------------- */
 
-void fpga_btn_reset(void);
-bool fpga_btn_forward_events(ICE40 *ice40, xQueueHandle buttonQueue, esp_err_t *err);
+#define FPGA_BTN_HOME       (1 << 5)
+#define FPGA_BTN_SELECT     (1 << 7)
+#define FPGA_BTN_START      (1 << 8)
+#define FPGA_BTN_BACK       (1 << 10)
+
+/* Badge combos are HOME + something: HOME quits a launched design, so
+ * unlike the other buttons designs can't rely on it */
+#define FPGA_BTN_RELOAD     (FPGA_BTN_HOME | FPGA_BTN_START)
+#define FPGA_BTN_EXIT       (FPGA_BTN_HOME | FPGA_BTN_BACK)
+
+void     fpga_btn_reset(void);
+uint16_t fpga_btn_get_state(void);
+void     fpga_btn_set_period(uint32_t period_ms);
+int64_t  fpga_btn_next_report(void);
+bool     fpga_btn_forward_events(ICE40 *ice40, xQueueHandle buttonQueue, esp_err_t *err);
+
+/* For callers reading the button queue themselves (e.g. through a queue set):
+ * apply every message received, then send one report with the merged mask */
+uint16_t fpga_btn_apply(const rp2040_input_message_t *msg);
+bool     fpga_btn_report(ICE40 *ice40, uint16_t btn_changed, esp_err_t *err);
+
+
+/* LCD passthrough -------------------------------------------------------- */
+
+/* Flag byte following SPI_CMD_LCD_PASSTHROUGH */
+#define FPGA_LCD_DC_CMD     0x00
+#define FPGA_LCD_DC_DATA    0x01
+
+esp_err_t fpga_lcd_write(ICE40 *ice40, bool dc, const uint8_t *data, size_t len);
+esp_err_t fpga_lcd_blit(ICE40 *ice40, const pax_buf_t *pax_buffer, int x, int y, int w, int h);
 
 
 /* Request processing ----------------------------------------------------- */
 
+#define FPGA_REQ_MAX_DATA   (8 * 1024 * 1024)   /* Largest in-memory data entry */
+
+struct fpga_req_stats {
+    uint32_t hits;          /* FREADs fully served from the read-ahead cache */
+    uint32_t misses;        /* FREADs that had to go to the file */
+    uint32_t prefetched;    /* Blocks read ahead in the background */
+    uint32_t wr_bytes;      /* FWRITE data written to the SD card */
+    uint32_t wr_dropped;    /* FWRITE data dropped (buffer full, bad target, I/O error) */
+};
+
 void fpga_req_setup(void);
 void fpga_req_cleanup(void);
 int  fpga_req_add_file_alias(uint32_t fid, const char *path);
 int  fpga_req_add_file_data(uint32_t fid, void *data, size_t len);
+void *fpga_req_alloc_file_data(uint32_t fid, size_t len);
+int  fpga_req_add_file_appfs(uint32_t fid, const char *name);
+int  fpga_req_add_file_partition(uint32_t fid, const char *label, size_t ofs, size_t len);
 void fpga_req_del_file(uint32_t fid);
+void fpga_req_get_stats(struct fpga_req_stats *stats);
 
-bool fpga_req_process(ICE40 *ice40, TickType_t wait, esp_err_t *err);
+/* Time (us) from fpga_req_trace_arm() to the first FREAD, -1 if none yet */
+void    fpga_req_trace_arm(void);
+int64_t fpga_req_trace_first_fread(void);
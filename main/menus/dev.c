@@ -33,6 +33,7 @@ typedef enum action {
     ACTION_BACK,
     ACTION_FPGA_DL,
     ACTION_FPGA_TEST,
+    ACTION_FPGA_BENCH,
     ACTION_FILE_BROWSER,
     ACTION_FILE_BROWSER_INT,
     ACTION_ANIMATION,
@@ -68,6 +69,7 @@ void menu_dev(xQueueHandle buttonQueue, pax_buf_t* pax_buffer, ILI9341* ili9341)
     
     menu_insert_item(menu, "FPGA download mode", NULL, (void*) ACTION_FPGA_DL, -1);
     menu_insert_item(menu, "FPGA selftest", NULL, (void*) ACTION_FPGA_TEST, -1);
+    menu_insert_item(menu, "FPGA SPI benchmark", NULL, (void*) ACTION_FPGA_BENCH, -1);
     menu_insert_item(menu, "File browser (SD card)", NULL, (void*) ACTION_FILE_BROWSER, -1);
     menu_insert_item(menu, "File browser (internal)", NULL, (void*) ACTION_FILE_BROWSER_INT, -1);
     menu_insert_item(menu, "Animation", NULL, (void*) ACTION_ANIMATION, -1);
@@ -128,6 +130,8 @@ void menu_dev(xQueueHandle buttonQueue, pax_buf_t* pax_buffer, ILI9341* ili9341)
                 fpga_download(buttonQueue, get_ice40(), pax_buffer, ili9341);
             } else if (action == ACTION_FPGA_TEST) {
                 fpga_test(buttonQueue, pax_buffer, ili9341);
+            } else if (action == ACTION_FPGA_BENCH) {
+                fpga_spi_bench(buttonQueue, pax_buffer, ili9341);
             } else if (action == ACTION_FILE_BROWSER) {
                 file_browser(buttonQueue, pax_buffer, ili9341, "/sd");
             } else if (action == ACTION_FILE_BROWSER_INT) {
@@ -14,6 +14,9 @@
 #include "menu.h"
 #include "rp2040.h"
 #include "appfs_wrapper.h"
+#include "fpga_download.h"
+#include "fpga_util.h"
+#include "hardware.h"
 
 extern const uint8_t apps_png_start[] asm("_binary_apps_png_start");
 extern const uint8_t apps_png_end[] asm("_binary_apps_png_end");
@@ -21,11 +24,13 @@ extern const uint8_t apps_png_end[] asm("_binary_apps_png_end");
 typedef enum {
     ACTION_NONE,
     ACTION_APPFS,
+    ACTION_FPGA,
     ACTION_BACK
 } menu_launcher_action_t;
 
 typedef struct {
     appfs_handle_t fd;
+    const char* name;
     menu_launcher_action_t action;
 } menu_launcher_args_t;
 
@@ -59,10 +64,13 @@ void menu_launcher(xQueueHandle buttonQueue, pax_buf_t* pax_buffer, ILI9341* ili
         appfsEntryInfoExt(appfs_fd, &name, &title, &version, NULL);
         menu_launcher_args_t* args = malloc(sizeof(menu_launcher_args_t));
         args->fd = appfs_fd;
-        args->action = ACTION_APPFS;
+        args->name = name;
+        args->action = fpga_lib_is_bitstream(name) ? ACTION_FPGA : ACTION_APPFS;
 
         char label[64];
-        if (version < 0xFFFF) {
+        if (args->action == ACTION_FPGA) {
+            snprintf(label, sizeof(label), "FPGA: %s", title);
+        } else if (version < 0xFFFF) {
             snprintf(label, sizeof(label), "%s (r%u)", title, version);
         } else {
             snprintf(label, sizeof(label), "%s (dev)", title);
@@ -126,6 +134,14 @@ void menu_launcher(xQueueHandle buttonQueue, pax_buf_t* pax_buffer, ILI9341* ili
         if (menuArgs != NULL) {
             if (menuArgs->action == ACTION_APPFS) {
                 appfs_boot_app(menuArgs->fd);
+            } else if (menuArgs->action == ACTION_FPGA) {
+                fpga_launch(buttonQueue, get_ice40(), pax_buffer, ili9341, menuArgs->name);
+                menuArgs = NULL;
+                render = true;
+                pax_background(pax_buffer, 0xFFFFFF);
+                pax_noclip(pax_buffer);
+                pax_draw_text(pax_buffer, 0xFF000000, font, 18, 5, 240 - 18, "[A] start app  [B] back");
+                continue;
             }
             break;
         }
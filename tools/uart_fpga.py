@@ -1,6 +1,6 @@
 #!/usr/bin/env python3
 
-import binascii, serial, time, sys, argparse
+import binascii, serial, time, sys, argparse, zlib, random, threading
 
 
 def uart_tx(title, data):
@@ -19,14 +19,115 @@ def uart_tx(title, data):
     print("", file=sys.stderr)
 
 
+def read_reply(prefix, timeout=5.0):
+    # Wait for a status line starting with prefix, skipping others
+    reply = b''
+    deadline = time.time() + timeout
+    while not reply.endswith(b'\n') and time.time() < deadline:
+        reply += port.read_until(b'\n', 64)
+        if reply.endswith(b'\n') and not reply.startswith(prefix):
+            reply = b''
+    return reply
+
+
+def header(ptype, fid, length, crc):
+    return b''.join([
+        ptype,
+        fid.to_bytes(4, byteorder='little'),
+        length.to_bytes(4, byteorder='little'),
+        crc.to_bytes(4, byteorder='little'),
+    ])
+
+
+def negotiate(baud):
+    if port.baudrate == baud:
+        return True
+
+    pattern = random.Random(baud).randbytes(4096)
+    port.write(header(b'S', baud, len(pattern), binascii.crc32(pattern)))
+
+    # Badge acknowledges at the old rate, then switches
+    if read_reply(b'baud ') != f"baud {baud:d}\n".encode('utf-8'):
+        return False
+
+    port.baudrate = baud
+    time.sleep(0.05)
+    port.write(pattern)
+
+    if read_reply(b'baud ') == b'baud ok\n':
+        return True
+
+    # Failed, both sides fall back to default
+    port.baudrate = DEFAULT_BAUD
+    read_reply(b'baud ', 2.0)
+    return False
+
+
+def loopback(length):
+    data = random.Random(length).randbytes(length)
+    echo = bytearray()
+
+    def rx():
+        deadline = time.time() + 10.0
+        while len(echo) < length and time.time() < deadline:
+            echo.extend(port.read(length - len(echo)))
+
+    t = threading.Thread(target=rx)
+    t0 = time.time()
+    t.start()
+    port.write(header(b'L', 0, length, binascii.crc32(data)))
+    port.write(data)
+    t.join()
+    dt = time.time() - t0
+
+    status = read_reply(b'loopback ', 2.0)
+    errors = sum(a != b for a, b in zip(data, echo)) + (length - len(echo))
+
+    return dt, errors, status == b'loopback ok\n'
+
+
+def show(line):
+    # Timing traces are 'timing[-pkt]: key=value ... us', make them readable
+    text = line.decode('utf-8', 'ignore')
+    if not text.startswith('timing'):
+        print(text, end='')
+        return
+
+    kind, _, fields = text.partition(':')
+    fields = dict(f.split('=', 1) for f in fields.split() if '=' in f)
+    # Skip anything mangled on the line rather than choke on it
+    fields = {k: v for k, v in fields.items() if k == 'type' or v.isdigit()}
+
+    if kind == 'timing-pkt':
+        ptype = fields.pop('type', '?')
+        length = fields.pop('len', '0')
+        length = int(length) if length.isdigit() else 0
+        print(f"  packet '{ptype:s}' {length:8d} bytes : " + ' '.join(f"{k:s} {int(v) / 1000:8.1f} ms" for k, v in fields.items()), file=sys.stderr)
+    else:
+        print("Timing : " + ', '.join(f"{k:s} {int(v) / 1000:.1f} ms" for k, v in fields.items()), file=sys.stderr)
+
+
 parser = argparse.ArgumentParser(description='MCH2022 badge FPGA bitstream programming tool')
 parser.add_argument("port", help="Serial port")
-parser.add_argument("bitstream", help="Bitstream binary")
-parser.add_argument("bindings", nargs="*", help="Data files/bindings")
+parser.add_argument("bitstream", nargs="?", help="Bitstream binary (not needed with --reload)")
+parser.add_argument("bindings", nargs="*", help="Data files/bindings: 'fid:file' (local data), '=fid:path' (badge file), '@fid:name' (AppFS file), '%%fid:label[:ofs[:len]]' (flash partition), '-fid' (clear)")
+parser.add_argument("-b", "--baud", type=int, default=921600, help="Baud rate to negotiate for the upload (921600, 1000000, 2000000, 3000000 or 4000000)")
+parser.add_argument("--loopback", action="store_true", help="Measure throughput and error rate at each baud rate before uploading")
+parser.add_argument("-z", "--compress", action="store_true", help="Send bitstream and data blocks zlib compressed")
+parser.add_argument("--no-cache", action="store_true", help="Always send the bitstream, even if the badge has it cached")
+parser.add_argument("--reload", action="store_true", help="Reload the last bitstream the badge kept, instead of sending one")
+parser.add_argument("--btn-period", type=int, default=0, help="Also report the button state to the FPGA every N ms (0 = only on changes)")
 args = parser.parse_args()
 
+if args.reload and args.bitstream is not None:
+    # No bitstream argument when reloading, it's the first binding
+    args.bindings.insert(0, args.bitstream)
+elif not args.reload and args.bitstream is None:
+    parser.error("a bitstream is required unless --reload is used")
+
 # Open UART
-port = serial.Serial(args.port, 921600, timeout=0.1)
+DEFAULT_BAUD = 921600
+port = serial.Serial(args.port, DEFAULT_BAUD, timeout=0.1)
 
 # Sync
 print("Waiting for badge...", file=sys.stderr)
@@ -39,6 +140,26 @@ while True:
 port.write(b'FPGA')
 time.sleep(0.5)
 
+# Loopback measurements
+if args.loopback:
+    for baud in [921600, 1000000, 2000000, 3000000, 4000000]:
+        if not negotiate(baud):
+            print(f"{baud:7d} baud : negotiation failed", file=sys.stderr)
+            continue
+        dt, errors, ok = loopback(65536)
+        print(f"{baud:7d} baud : {65536 / dt / 1024:7.1f} KB/s, {errors:d} byte errors{'' if ok else ', badge CRC fail'}", file=sys.stderr)
+    negotiate(DEFAULT_BAUD)
+
+# Switch speed
+if args.baud != DEFAULT_BAUD:
+    if negotiate(args.baud):
+        print(f"Running at {args.baud:d} baud", file=sys.stderr)
+    else:
+        print(f"Failed to switch to {args.baud:d} baud, staying at {DEFAULT_BAUD:d}", file=sys.stderr)
+
+# Periodic button reports
+port.write(header(b'R', args.btn_period, 0, 0))
+
 # Send the data bindings if any
 for binfo in args.bindings:
     # Clear ?
@@ -65,6 +186,38 @@ for binfo in args.bindings:
             path,
         ]
 
+    # AppFS file binding ?
+    elif binfo[0] == '@':
+        fid, name = binfo[1:].split(':',2)
+        fid = int(fid, 0)
+        title = f"Binding FID 0x{fid:08x} to AppFS file '{name:s}'"
+        name = name.encode('utf-8')
+        packet = [
+            b'A',
+            fid.to_bytes(4, byteorder='little'),
+            len(name).to_bytes(4, byteorder='little'),
+            binascii.crc32(name).to_bytes(4, byteorder='little'),
+            name,
+        ]
+
+    # Flash partition binding ? (label[:offset[:length]])
+    elif binfo[0] == '%':
+        fid, region = binfo[1:].split(':',1)
+        fid = int(fid, 0)
+        region = region.split(':')
+        label = region[0]
+        ofs = int(region[1], 0) if len(region) > 1 else 0
+        length = int(region[2], 0) if len(region) > 2 else 0
+        title = f"Binding FID 0x{fid:08x} to partition '{label:s}' @ 0x{ofs:x}"
+        data = ofs.to_bytes(4, byteorder='little') + length.to_bytes(4, byteorder='little') + label.encode('utf-8')
+        packet = [
+            b'P',
+            fid.to_bytes(4, byteorder='little'),
+            len(data).to_bytes(4, byteorder='little'),
+            binascii.crc32(data).to_bytes(4, byteorder='little'),
+            data,
+        ]
+
     # Data bindings ? (Local file)
     else:
         fid, path = binfo[0:].split(':',2)
@@ -72,8 +225,10 @@ for binfo in args.bindings:
         title = f"Sending data block for FID 0x{fid:08x} (local file '{path:s}')"
         with open(path, "rb") as fh:
             data = fh.read()
+        if args.compress:
+            data = len(data).to_bytes(4, byteorder='little') + zlib.compress(data, 9)
         packet = [
-            b'D',
+            b'z' if args.compress else b'D',
             fid.to_bytes(4, byteorder='little'),
             len(data).to_bytes(4, byteorder='little'),
             binascii.crc32(data).to_bytes(4, byteorder='little'),
@@ -83,28 +238,82 @@ for binfo in args.bindings:
     # Send it
     uart_tx(title, b''.join(packet))
 
-# Send the bitstream itself
-with open(args.bitstream, "rb") as fh:
-    bitstream = fh.read()
+# Reload what the badge has kept from last time
+if args.reload:
+    print("Reloading last bitstream", file=sys.stderr)
+    port.write(header(b'X', 0, 0, 0))
+
+else:
+    # Send the bitstream itself
+    with open(args.bitstream, "rb") as fh:
+        bitstream = fh.read()
+
+    bitstream_crc = binascii.crc32(bitstream)
+
+    # Ask if the badge has it cached already
+    cached = False
+
+    if not args.no_cache:
+        port.write(header(b'H', len(bitstream), 0, bitstream_crc))
+
+        # The badge always answers, wait for it
+        cached = (read_reply(b'cache ') == b'cache hit\n')
+
+    if cached:
+        print("Bitstream loaded from badge cache", file=sys.stderr)
+
+    elif args.compress:
+        payload = b''.join([
+            len(bitstream).to_bytes(4, byteorder='little'),
+            bitstream_crc.to_bytes(4, byteorder='little'),
+            zlib.compress(bitstream, 9),
+        ])
+
+        bitstream_packet = [
+            b'Z\x00\x00\x00\x00',
+            len(payload).to_bytes(4, byteorder='little'),
+            binascii.crc32(payload).to_bytes(4, byteorder='little'),
+            payload,
+        ]
+
+        uart_tx(f"Sending compressed bitstream ({len(payload)}/{len(bitstream)} bytes)", b''.join(bitstream_packet))
+
+    else:
+        bitstream_packet = [
+            b'B\x00\x00\x00\x00',
+            len(bitstream).to_bytes(4, byteorder='little'),
+            bitstream_crc.to_bytes(4, byteorder='little'),
+            bitstream,
+        ]
 
-    bitstream_packet = [
-        b'B\x00\x00\x00\x00',
-        len(bitstream).to_bytes(4, byteorder='little'),
-        binascii.crc32(bitstream).to_bytes(4, byteorder='little'),
-        bitstream,
-    ]
+        uart_tx("Sending bitstream", b''.join(bitstream_packet))
 
-    uart_tx("Sending bitstream", b''.join(bitstream_packet))
 
+# Badge goes back to default speed once done
+if port.baudrate != DEFAULT_BAUD:
+    deadline = time.time() + 10.0
+    while time.time() < deadline:
+        line = port.read_until(b'\n', 128)
+        if line:
+            show(line)
+        if line.startswith(b'timing:') or b'failed' in line:
+            break
+    time.sleep(0.01)
+    port.baudrate = DEFAULT_BAUD
 
 # Print messages
+pending = b''
 while port.is_open:
     inLen = port.in_waiting
     if inLen > 0:
-        data = port.read(inLen).decode('utf-8','ignore');
-        if data != 'FPGA':
-            print(data, end='')
-            sys.stdout.flush()
+        pending += port.read(inLen)
+        # Whole lines only, and skip the badge sync words
+        while b'\n' in pending:
+            line, pending = pending.split(b'\n', 1)
+            show(line.replace(b'FPGA', b'') + b'\n')
+        if pending == b'FPGA':
+            pending = b''
+        sys.stdout.flush()
     else:
         time.sleep(0.01)
 
@@ -30,6 +30,7 @@ class Commands(Enum):
     EXECFILE = 0
     HEARTBEAT = 1
     APPFSBOOT = 3
+    XFERSTATS = 4
     GETDIR = 4096
     READFILE = 4097
     WRITEFILE = 4098
@@ -185,6 +186,35 @@ class WebUSB():
                 result["dirs"].append(fd[1:])
         return result
 
+    def readFSfile(self, filename):
+        """
+        Download file from fs
+        root path should /flash or /sdcard
+
+        parameters:
+            filename (str) : name of the file
+
+        returns:
+            bytes : file contents
+        """
+
+        return self.sendPacket(WebUSBPacket(Commands.READFILE, self.getMessageId(), filename.encode(encoding='ascii')))
+
+    def getTransferStats(self):
+        """
+        Get badge side figures of the last file read
+
+        parameters:
+            None
+
+        returns:
+            tuple : (bytes sent, time taken in microseconds)
+        """
+
+        data = self.sendPacket(WebUSBPacket(Commands.XFERSTATS, self.getMessageId()))
+        nbytes, us = data.decode().rstrip('\x00').split()
+        return (int(nbytes), int(us))
+
     def pushFSfile(self, filename, file):
         """
         Upload file to fs
@@ -0,0 +1,20 @@
+#!/usr/bin/env python3
+from webusb import *
+import argparse
+
+parser = argparse.ArgumentParser(description='MCH2022 fs pull tool')
+parser.add_argument("name", help="filename on the badge")
+parser.add_argument("target", help="filename local")
+args = parser.parse_args()
+
+dev = WebUSB()
+start = time.time()
+data = dev.readFSfile(args.name)
+elapsed = time.time() - start
+with open(args.target, "wb") as file:
+    file.write(data)
+print(f"File downloaded: {len(data)} bytes in {elapsed:.2f} s ({len(data) / elapsed / 1024:.1f} KB/s)")
+
+nbytes, us = dev.getTransferStats()
+if us:
+    print(f"Badge side: {nbytes} bytes in {us / 1000:.1f} ms ({nbytes * 1000000 / us / 1024:.1f} KB/s)")